@@ -2,6 +2,7 @@
 #define KBBQ_BLOOM_HH
 #include <cstdint>
 #include <utility>
+#include <array>
 #include <htslib/hts.h>
 #include <minion.hpp>
 #include <memory>
@@ -253,9 +254,13 @@ public:
 	}
 
 	inline virtual void insert(const unsigned char* key_begin, const size_t& length){
-		//index in table with first byte of block
-		size_t block = get_block(hash_ap(key_begin, length, salt_[0]));
-		size_t pattern = get_pattern(hash_ap(key_begin, length, salt_[1]));
+		insert_at(locate(key_begin, length));
+	}
+
+	//insert a key given the {block, pattern} offsets from locate.
+	inline void insert_at(const std::pair<size_t,size_t>& loc){
+		size_t block = loc.first;
+		size_t pattern = loc.second;
 		static_assert(block_size / bits_per_char / sizeof(cell_type) > 0,
 			"Block size must be greater than or equal to size of cell type.");
 		cell_type* bit_block = reinterpret_cast<cell_type*>(__builtin_assume_aligned(bit_table_.get() + block, block_size / bits_per_char));
@@ -274,9 +279,36 @@ public:
 	}
 
 	inline virtual bool contains(const unsigned char* key_begin, const size_t length) const{
-		//index in table with first byte of block
-		size_t block = get_block(hash_ap(key_begin, length, salt_[0]));
-		size_t pattern = get_pattern(hash_ap(key_begin, length, salt_[1]));
+		return contains_at(locate(key_begin, length));
+	}
+
+	template <typename T>
+	inline bool contains(const T& t) const
+	{
+		return contains(reinterpret_cast<const unsigned char*>(&t),static_cast<std::size_t>(sizeof(T)));
+	}
+
+	//get the {block, pattern} offsets a key maps to. these can be prefetched
+	//for several keys before any of them are tested with contains_at.
+	inline std::pair<size_t,size_t> locate(const unsigned char* key_begin, const size_t length) const{
+		return std::make_pair(get_block(hash_ap(key_begin, length, salt_[0])),
+			get_pattern(hash_ap(key_begin, length, salt_[1])));
+	}
+
+	template <typename T>
+	inline std::pair<size_t,size_t> locate(const T& t) const{
+		return locate(reinterpret_cast<const unsigned char*>(&t),static_cast<std::size_t>(sizeof(T)));
+	}
+
+	//both the block and the pattern are a single cache line.
+	inline void prefetch(const std::pair<size_t,size_t>& loc) const{
+		__builtin_prefetch(bit_table_.get() + loc.first);
+		__builtin_prefetch(patterns.get() + loc.second);
+	}
+
+	inline bool contains_at(const std::pair<size_t,size_t>& loc) const{
+		size_t block = loc.first;
+		size_t pattern = loc.second;
 		static_assert(block_size / bits_per_char / sizeof(cell_type) > 0,
 			"Block size must be greater than or equal to size of cell type.");
 		cell_type* bit_block = reinterpret_cast<cell_type*>(__builtin_assume_aligned(bit_table_.get() + block, block_size / bits_per_char));
@@ -291,12 +323,6 @@ public:
 		return true;
 	}
 
-	template <typename T>
-	inline bool contains(const T& t) const
-	{
-		return contains(reinterpret_cast<const unsigned char*>(&t),static_cast<std::size_t>(sizeof(T)));
-	}
-
 	inline virtual bloom_type block_hash(const unsigned char* key_begin, const size_t& length) const{
 		return hash_ap(key_begin, length, salt_[0]);
 	}
@@ -348,7 +374,11 @@ public:
 	Kmer(const Kmer& o): k(o.k), s(o.s), mask(o.mask), shift(o.shift), x{o.x[0], o.x[1]} {}
 	//add a character and return the number of times the kmer has been added to since last reset
 	inline size_t push_back(char ch){
-		int c = seq_nt16_int[seq_nt16_table[ch]];
+		return this->push_back_int(seq_nt16_int[seq_nt16_table[ch]]);
+	}
+	//add an already 2-bit encoded base (A=0, C=1, G=2, T=3; anything larger is an N)
+	//and return the number of times the kmer has been added to since last reset
+	inline size_t push_back_int(int c){
 		if (c < 4){
 			x[0] = (x[0] << 2 | c) & mask;                  // forward strand
 			x[1] = x[1] >> 2 | (uint64_t)(3 - c) << shift;  // reverse strand
@@ -358,6 +388,34 @@ public:
 	}
 	//get encoded kmer
 	inline uint64_t get() const{return x[0] < x[1] ? x[0] : x[1];} //min of x[0] and x[1]
+	//get the encoded kmers made by appending each base (in ACGT order) without modifying this one.
+	//they are only valid if size() >= k-1.
+	inline std::array<uint64_t,4> successors() const{
+		std::array<uint64_t,4> ret;
+		for(int c = 0; c < 4; ++c){
+			uint64_t fwd = (x[0] << 2 | c) & mask;
+			uint64_t rev = x[1] >> 2 | (uint64_t)(3 - c) << shift;
+			ret[c] = fwd < rev ? fwd : rev;
+		}
+		return ret;
+	}
+	//get the encoded kmers made by replacing the base at pos (0 is the oldest base)
+	//with each base in ACGT order. they are only valid if this kmer is.
+	inline std::array<uint64_t,4> substitutions(int pos) const{
+		std::array<uint64_t,4> ret;
+		for(int c = 0; c < 4; ++c){
+			ret[c] = this->substitution(pos, c);
+		}
+		return ret;
+	}
+	//get the encoded kmer made by replacing the base at pos with base c.
+	inline uint64_t substitution(int pos, int c) const{
+		int fwdshift = 2*(k-1-pos);
+		int revshift = 2*pos;
+		uint64_t fwd = (x[0] & ~(3ULL << fwdshift)) | (uint64_t)c << fwdshift;
+		uint64_t rev = (x[1] & ~(3ULL << revshift)) | (uint64_t)(3 - c) << revshift;
+		return fwd < rev ? fwd : rev;
+	}
 	//get encoded prefix
 	inline uint64_t prefix() const{return this->get()&((1<<PREFIXBITS)-1);}
 	//empty the kmer and set s to 0
@@ -395,7 +453,32 @@ public:
 	inline void insert(const Kmer& kmer){if(kmer.valid()){bloom.insert(kmer.get());}}
 	template <typename T>
 	inline void insert(const T& t){bloom.insert(t);}
+	//insert a batch of encoded kmers (see Kmer::get), prefetching a few kmers
+	//ahead of the one being inserted.
+	void insert_batch(const std::vector<uint64_t>& kmers);
 	inline bool query(const Kmer& kmer) const {return (kmer.valid() && bloom.contains(kmer.get()));}
+	//query 4 encoded kmers at once, prefetching all of them before testing any.
+	//bit i of the result is set if kmers[i] is in the filter.
+	inline uint8_t query_mask(const std::array<uint64_t,4>& kmers) const {
+		std::array<std::pair<size_t,size_t>,4> locs;
+		for(int i = 0; i < 4; ++i){
+			locs[i] = bloom.locate(kmers[i]);
+			bloom.prefetch(locs[i]);
+		}
+		uint8_t mask = 0;
+		for(int i = 0; i < 4; ++i){
+			mask |= bloom.contains_at(locs[i]) << i;
+		}
+		return mask;
+	}
+	//bit i is set if appending base i (A=0, C=1, G=2, T=3) to kmer makes a kmer in the filter.
+	inline uint8_t query_successors(const Kmer& kmer) const {
+		return kmer.size() + 1 >= kmer.ksize() ? query_mask(kmer.successors()) : 0;
+	}
+	//bit i is set if replacing the base at pos in kmer with base i makes a kmer in the filter.
+	inline uint8_t query_substitutions(const Kmer& kmer, int pos) const {
+		return kmer.valid() ? query_mask(kmer.substitutions(pos)) : 0;
+	}
 	inline double fprate() const {return bloom.effective_fpp();}
 	inline unsigned long long inserted_elements() const {return bloom.element_count();}
 	// inline double fprate() const {return bloom.GetActualFP();}
@@ -403,14 +486,163 @@ public:
 
 // typedef std::array<Bloom,(1<<PREFIXBITS)> bloomary_t;
 
+//the complement of a base; anything that isn't A, C, G or T becomes an N.
+inline char complement(char c){return "TGCAN"[seq_nt16_int[seq_nt16_table[c]]];}
+
+//a non-owning view of a stretch of sequence. the characters must outlive the view.
+//the correction functions below take these so they can work on part of a read
+//without copying it. a view can also read its sequence as the reverse complement,
+//so correction can run leftward over a read without building a reversed copy.
+class SeqView{
+protected:
+	const char* s; //the first base of the view; the last base of the sequence if rc
+	size_t len;
+	bool rc;
+	SeqView(const char* s, size_t len, bool rc): s(s), len(len), rc(rc) {}
+public:
+	SeqView(const char* s, size_t len): s(s), len(len), rc(false) {}
+	SeqView(const std::string& str): s(str.data()), len(str.length()), rc(false) {}
+	inline char operator[](size_t i) const {return rc ? complement(*(s - i)) : s[i];}
+	//the 2-bit code of the base at i, or 4 if it isn't A, C, G or T.
+	inline int code(size_t i) const {
+		int c = seq_nt16_int[seq_nt16_table[rc ? *(s - i) : s[i]]];
+		return rc && c < 4 ? 3 - c : c;
+	}
+	inline size_t length() const {return len;}
+	inline SeqView substr(size_t pos, size_t count = std::string::npos) const {
+		return SeqView(rc ? s - pos : s + pos, std::min(count, len - pos), rc);
+	}
+	//a view of the reverse complement of this one. base i of it is the complement
+	//of base length()-1-i of this view.
+	inline SeqView revcomp() const {
+		return SeqView(rc ? s - (len - 1) : s + (len - 1), len, !rc);
+	}
+	inline std::string str() const {
+		std::string ret(len, 'N');
+		for(size_t i = 0; i < len; ++i){ret[i] = (*this)[i];}
+		return ret;
+	}
+};
+
+//which kmers of a sequence are trusted, one bit per kmer. bit i is set if the kmer
+//starting at base i is valid and in the filter. runs of trusted kmers are found
+//a word at a time by counting trailing (or leading) zeros.
+class TrustedKmers{
+protected:
+	std::vector<uint64_t> bits;
+	size_t n = 0; //number of kmers
+	//w with the bits of word i that fall outside [begin, end) cleared
+	static inline uint64_t mask(uint64_t w, size_t i, size_t begin, size_t end){
+		if(i == begin >> 6){w &= ~0ULL << (begin & 63);}
+		if(i == (end - 1) >> 6 && (end & 63) != 0){w &= ~0ULL >> (64 - (end & 63));}
+		return w;
+	}
+public:
+	//query every kmer of seq (anything with length() and code(i)). the filter lookups
+	//are prefetched a few kmers ahead of the one being tested.
+	template<typename Seq>
+	void fill(const Seq& seq, const Bloom& b, int k){
+		static const size_t lookahead = 8;
+		std::array<std::pair<size_t,size_t>, lookahead> locs;
+		std::array<size_t, lookahead> idx;
+		size_t queued = 0;
+		size_t tested = 0;
+		n = seq.length() >= k ? seq.length() - k + 1 : 0;
+		bits.assign((n + 63) / 64, 0);
+		Kmer kmer(k);
+		for(size_t i = 0; i < seq.length(); ++i){
+			kmer.push_back_int(seq.code(i));
+			if(!kmer.valid()){continue;}
+			if(queued - tested == lookahead){
+				this->set(idx[tested % lookahead], b.bloom.contains_at(locs[tested % lookahead]));
+				++tested;
+			}
+			locs[queued % lookahead] = b.bloom.locate(kmer.get());
+			b.bloom.prefetch(locs[queued % lookahead]);
+			idx[queued % lookahead] = i + 1 - k;
+			++queued;
+		}
+		for(; tested < queued; ++tested){
+			this->set(idx[tested % lookahead], b.bloom.contains_at(locs[tested % lookahead]));
+		}
+	}
+	//requery the kmers that contain base pos of seq after it has changed.
+	template<typename Seq>
+	void requery(const Seq& seq, const Bloom& b, int k, size_t pos){
+		if(n == 0){return;}
+		size_t first = pos >= k - 1 ? pos + 1 - k : 0;
+		size_t last = std::min(pos, n - 1); //inclusive
+		Kmer kmer(k);
+		for(size_t i = first; i < last + k; ++i){
+			kmer.push_back_int(seq.code(i));
+			if(i + 1 >= first + k){
+				this->set(i + 1 - k, b.query(kmer));
+			}
+		}
+	}
+	inline size_t size() const {return n;}
+	inline bool operator[](size_t i) const {return bits[i >> 6] >> (i & 63) & 1;}
+	inline void set(size_t i, bool v){
+		bits[i >> 6] = (bits[i >> 6] & ~(1ULL << (i & 63))) | (uint64_t)v << (i & 63);
+	}
+	//whether every kmer is trusted. false if there are no kmers.
+	inline bool all() const {return n > 0 && next_unset(0, n) == n;}
+	//the first set (or unset) bit in [begin, end); end if there is none.
+	inline size_t next_set(size_t begin, size_t end) const {
+		for(size_t i = begin >> 6; begin < end && i <= (end - 1) >> 6; ++i){
+			uint64_t w = mask(bits[i], i, begin, end);
+			if(w != 0){return (i << 6) + __builtin_ctzll(w);}
+		}
+		return end;
+	}
+	inline size_t next_unset(size_t begin, size_t end) const {
+		for(size_t i = begin >> 6; begin < end && i <= (end - 1) >> 6; ++i){
+			uint64_t w = mask(~bits[i], i, begin, end);
+			if(w != 0){return (i << 6) + __builtin_ctzll(w);}
+		}
+		return end;
+	}
+	//the last unset bit in [begin, end); end if there is none.
+	inline size_t prev_unset(size_t begin, size_t end) const {
+		for(size_t i = (end - 1) >> 6; begin < end && i + 1 > begin >> 6; --i){
+			uint64_t w = mask(~bits[i], i, begin, end);
+			if(w != 0){return (i << 6) + 63 - __builtin_clzll(w);}
+		}
+		return end;
+	}
+};
+
+//the trust of the kmers of a SeqView, looked up in the TrustedKmers of the sequence
+//the view was taken from. kmer i of the view is kmer base + i of that sequence, or
+//base - i if the view is of its reverse complement.
+struct TrustedKmersView{
+	const TrustedKmers* kmers;
+	size_t base;
+	bool reversed;
+	//the first untrusted kmer of the view in [begin, end); end if they're all trusted.
+	inline size_t next_untrusted(size_t begin, size_t end) const {
+		if(begin >= end){return end;}
+		if(!reversed){
+			return kmers->next_unset(base + begin, base + end) - base;
+		}
+		size_t found = kmers->prev_unset(base + 1 - end, base + 1 - begin);
+		return found == base + 1 - begin ? end : base - found;
+	}
+};
+
 std::array<std::vector<size_t>,2> overlapping_kmers_in_bf(std::string seq, const Bloom& b, int k = 31);
 
+//as above, but with the kmers of a sequence of length len already computed.
+//kmers[i] should end at position i+k-1.
+std::array<std::vector<size_t>,2> overlapping_kmers_in_bf(const std::vector<Kmer>& kmers, size_t len, const Bloom& b, int k = 31);
+
 //return the total number of kmers in b
 int nkmers_in_bf(std::string seq, const Bloom& b, int k);
 
 //given a kmer, get the next character (in ACGT order) that would create a trusted
 //kmer when appended and return it. Return 0 if none would be trusted.
 //Set the flag to test in TGCA order instead.
+//All four extensions are queried together with Bloom::query_successors.
 char get_next_trusted_char(const bloom::Kmer& kmer, const Bloom& trusted, bool reverse_test_order = false);
 
 //return the INCLUSIVE indices bounding the largest stretch of trusted sequence
@@ -418,15 +650,22 @@ char get_next_trusted_char(const bloom::Kmer& kmer, const Bloom& trusted, bool r
 //if the 2nd value is -1 (== std::string::npos), until the end of the string is trusted.
 //thus the whole string being trusted looks like {0, std::string::npos}
 //while no part of the string being trusted looks like {std::string::npos, std::string::npos}
-std::array<size_t,2> find_longest_trusted_seq(std::string seq, const Bloom& b, int k);
+std::array<size_t,2> find_longest_trusted_seq(SeqView seq, const Bloom& b, int k);
+
+//as above, for [offset, offset+len) of a sequence whose kmers have already been queried.
+//the indices returned are relative to offset.
+std::array<size_t,2> find_longest_trusted_seq(const TrustedKmers& kmers, size_t offset, size_t len, int k);
 
 //find the longest possible fix for the kmer at position (k-1) until the end
-//return the best character (multiple in case of a tie), the index of the next untrusted base,
-// and whether multiple corrections were considered for the fix.
-//if the length of the fix character vector is 0, no fix was found and correction should end.
+//replace fixes with the best character (multiple in case of a tie) and return the index
+//of the next untrusted base and whether multiple corrections were considered for the fix.
+//if the length of fixes is 0, no fix was found and correction should end.
 //If the sequence is reverse-complemented, set the flag to test bases in reverse order
 // (TGCA) instead of (ACGT)
-std::tuple<std::vector<char>, size_t, bool> find_longest_fix(std::string seq, const Bloom& t, int k, bool reverse_test_order = false);
+//If the trust of the kmers of seq is already known, pass it as known; kmers that
+//can't contain the fix are then looked up instead of queried.
+std::pair<size_t, bool> find_longest_fix(SeqView seq, const Bloom& t, int k, std::vector<char>& fixes, bool reverse_test_order = false,
+	const TrustedKmersView* known = NULL);
 
 //given the sampling rate, calculate the probability any kmer is in the array.
 long double calculate_phit(const Bloom& bf, long double alpha);
@@ -443,12 +682,12 @@ int numhashes(long double fpr);
 //ensure anchor >= k before this function is called.
 //return {anchor, multiple}, the location of the new anchor and whether multiple corrections
 //were possible during anchor adjustment.
-std::pair<size_t, bool> adjust_right_anchor(size_t anchor, std::string seq, const Bloom& trusted, int k);
+std::pair<size_t, bool> adjust_right_anchor(size_t anchor, SeqView seq, const Bloom& trusted, int k);
 
 //get the biggest consecutive trusted block, for creating a trusted anchor when
 //one doesn't exist. If there are too many consecutive misses, the procedure
 //will end early. 94518
-int biggest_consecutive_trusted_block(std::string seq, const Bloom& trusted, int k, int current_len);
+int biggest_consecutive_trusted_block(SeqView seq, const Bloom& trusted, int k, int current_len);
 
 }
 
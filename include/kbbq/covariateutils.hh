@@ -8,6 +8,9 @@
 #include <random>
 #include <array>
 #include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include "readutils.hh"
 #include "recalibrateutils.hh"
 
@@ -21,16 +24,256 @@ namespace covariateutils{
 typedef std::vector<int> meanq_t;
 typedef std::vector<int> rgdq_t;
 typedef std::vector<std::vector<int>> qscoredq_t;
-typedef std::vector<std::vector<std::array<std::vector<int>,2>>> cycledq_t;
-typedef std::vector<std::vector<std::vector<int>>> dinucdq_t;
+typedef std::vector<std::vector<std::vector<int>>> keydq_t; //rg -> q -> key
+
+//what covariates know about a base when they compute its key. walk a read by setting
+//cycle and q and calling push with the code of each base in order.
+struct BaseInfo{
+	size_t cycle = 0; //the index of the base in the read, in the forward orientation
+	bool second = false; //whether the read is the second of a pair
+	int q = 0;
+	bool lowq = false; //whether q is too low for the base's context to count
+	uint64_t context = 0; //the 2-bit codes of the bases up to this one; this one is in the low bits
+	int run = 0; //the number of non-N bases in a row ending at this one
+	inline void push(int code){
+		if(code < 4){
+			context = context << 2 | code;
+			++run;
+		} else {
+			run = 0;
+		}
+	}
+};
+
+//the covariates below read group and quality score. each is fit separately with the
+//quality score's fit as its prior, and each declares:
+//  name(): its name in reports
+//  nkeys(len): how many keys it needs for reads up to len bases long
+//  key(b): the key of the base, or -1 if the base doesn't count toward it
+//  key_str(key): the key in readable form
+//  parse_key(s, len): the key key_str writes as the len characters at s, or -1 if there isn't one
+//keys must not change meaning when nkeys grows, since longer reads can be seen at any time.
+
+//the position of the base in the read. cycles of second reads are negative in reports.
+//cycles below exact each get their own key; later ones share keys in bins, so the number
+//of keys stays bounded for long reads. with width set the bins are width cycles wide.
+//otherwise they're log-spaced: bins start 2 cycles wide and double in width each time
+//the cycle doubles, so no bin is wider than 2/exact of its first cycle. exact must then
+//be a power of 2. the binning is chosen at run time by set_binning, before any reads are
+//counted; by default the first 256 cycles are exact and later ones are log-spaced.
+struct CycleCovariate{
+	static size_t exact;
+	static size_t width; //0 for log-spaced bins
+	static size_t half; //the number of log-spaced bins per doubling
+	static int log2_exact;
+	//throws std::invalid_argument if the binning isn't one described above.
+	static void set_binning(size_t exact, size_t width = 0);
+	static inline size_t bin(size_t cycle){
+		if(cycle < exact){
+			return cycle;
+		} else if(width > 0){
+			return exact + (cycle - exact) / width;
+		} else {
+			int octave = 63 - __builtin_clzll(cycle) - log2_exact; //cycle is in [exact << octave, exact << octave + 1)
+			return exact + octave * half + ((cycle >> (octave + 1)) - half);
+		}
+	}
+	//the first cycle in a bin
+	static inline size_t bin_start(size_t bin){
+		if(bin < exact){
+			return bin;
+		} else if(width > 0){
+			return exact + (bin - exact) * width;
+		} else {
+			size_t octave = (bin - exact) / half;
+			return (half + (bin - exact) % half) << (octave + 1);
+		}
+	}
+	static inline const char* name(){return "Cycle";}
+	static inline size_t nkeys(size_t len){return len > 0 ? 2 * (bin(len - 1) + 1) : 0;}
+	//first and second reads are interleaved so the keys don't move as len grows.
+	static inline long key(const BaseInfo& b){return 2 * bin(b.cycle) + b.second;}
+	//the first cycle of the key's bin
+	static inline std::string key_str(size_t key){
+		long cycle = bin_start(key / 2) + 1;
+		return std::to_string(key & 1 ? -cycle : cycle);
+	}
+	static inline long parse_key(const char* s, size_t len){
+		char* end;
+		long cycle = std::strtol(s, &end, 10);
+		if(end != s + len || cycle == 0){return -1;}
+		return 2 * bin(std::labs(cycle) - 1) + (cycle < 0);
+	}
+};
+
+//the K bases ending at this one, packed 2 bits per base. bases with an N in their context
+//or with a quality below the minimum don't count.
+template<int K>
+struct ContextCovariate{
+	static_assert(K >= 1 && K <= 8, "ContextCovariate supports contexts of 1 to 8 bases.");
+	static const uint64_t mask = (1ULL << 2 * K) - 1;
+	static inline const char* name(){return "Context";}
+	static inline size_t nkeys(size_t len){return mask + 1;}
+	static inline long key(const BaseInfo& b){return b.run >= K && !b.lowq ? (long)(b.context & mask) : -1;}
+	static inline std::string key_str(size_t key){
+		std::string s(K, 'N');
+		for(int i = K - 1; i >= 0; --i, key >>= 2){
+			s[i] = "ACGT"[key & 3];
+		}
+		return s;
+	}
+	static inline long parse_key(const char* s, size_t len){
+		if(len != K){return -1;}
+		long key = 0;
+		for(size_t i = 0; i < len; ++i){
+			int code = seq_nt16_int[seq_nt16_table[(unsigned char)s[i]]];
+			if(code > 3){return -1;}
+			key = key << 2 | code;
+		}
+		return key;
+	}
+};
+
+//the base before this one and this one; GATK's default context.
+typedef ContextCovariate<2> DinucCovariate;
+
+//a longer context, with its length chosen at run time by set_size before any reads are
+//counted. it's off (no base has a key) until then. it's reported under its own name, so
+//Context keeps the meaning GATK gives it.
+struct LongContextCovariate{
+	static int size; //0 when off
+	static uint64_t mask;
+	//throws std::invalid_argument unless k is 0 or a length from 1 to 8 other than 2,
+	//which would count every dinucleotide twice.
+	static void set_size(int k);
+	static inline const char* name(){return "LongContext";}
+	static inline size_t nkeys(size_t len){return size > 0 ? mask + 1 : 0;}
+	static inline long key(const BaseInfo& b){return size > 0 && b.run >= size && !b.lowq ? (long)(b.context & mask) : -1;}
+	static inline std::string key_str(size_t key){
+		std::string s(size, 'N');
+		for(int i = size - 1; i >= 0; --i, key >>= 2){
+			s[i] = "ACGT"[key & 3];
+		}
+		return s;
+	}
+	static inline long parse_key(const char* s, size_t len){
+		if(size == 0 || len != (size_t)size){return -1;}
+		long key = 0;
+		for(size_t i = 0; i < len; ++i){
+			int code = seq_nt16_int[seq_nt16_table[(unsigned char)s[i]]];
+			if(code > 3){return -1;}
+			key = key << 2 | code;
+		}
+		return key;
+	}
+};
+
+template<typename... Covariates>
+struct CovariateList{
+	static const size_t size = sizeof...(Covariates);
+};
+
+//call f.template apply<I, Covariate>() for each covariate in the list, in order.
+//the calls are generated at compile time, so a loop over the covariates of a base
+//compiles to the covariates' key functions one after another.
+template<typename List, size_t I = 0>
+struct ForEachCovariate;
+
+template<size_t I>
+struct ForEachCovariate<CovariateList<>, I>{
+	template<typename F>
+	static inline void apply(F& f){}
+};
+
+template<typename Covariate, typename... Rest, size_t I>
+struct ForEachCovariate<CovariateList<Covariate, Rest...>, I>{
+	template<typename F>
+	static inline void apply(F& f){
+		f.template apply<I, Covariate>();
+		ForEachCovariate<CovariateList<Rest...>, I + 1>::apply(f);
+	}
+};
+
+//the covariates in the model. to add one, define it like the ones above and list it here;
+//counting, fitting and recalibration all loop over this list.
+typedef CovariateList<CycleCovariate, DinucCovariate, LongContextCovariate> model_covariates;
+static const size_t ncovariates = model_covariates::size;
+
+//the name of covariate i in model_covariates and the readable form of one of its keys
+std::string covariate_name(size_t i);
+std::string covariate_key_str(size_t i, size_t key);
+long covariate_parse_key(size_t i, const char* s, size_t len);
 
 struct dq_t
 {
 	meanq_t meanq;
 	rgdq_t rgdq;
 	qscoredq_t qscoredq;
-	cycledq_t cycledq;
-	dinucdq_t dinucdq;
+	std::array<keydq_t, ncovariates> covariatedq; //in the order of model_covariates
+};
+
+//the model in dq_t laid out flat for recalibration: the fit of each read group and
+//quality score, and the dq of every key of each covariate in model_covariates.
+//build it once after training. recalibrating a base is one lookup for its quality
+//plus one per covariate, found in a single walk over the read.
+//qualities below minqual and qualities that weren't seen in training are only clamped;
+//keys that weren't seen add nothing.
+class RecalibrationTable{
+protected:
+	int nrg = 0;
+	int nq = 0;
+	static const int16_t untrained = std::numeric_limits<int16_t>::min();
+	std::vector<int16_t> base; //rg -> q; untrained if the quality isn't recalibrated
+	//a covariate's prior and fit are both qualities, so its dqs fit in 8 bits.
+	std::array<std::vector<int8_t>, ncovariates> dqs; //rg -> q -> key
+	std::array<size_t, ncovariates> nkeys{};
+	int minqual;
+	static inline uint8_t clamp(int q){return q < 0 ? 0 : KBBQ_MAXQ < q ? KBBQ_MAXQ : q;} //std::clamp in c++17
+	struct AddDq{
+		const RecalibrationTable& t;
+		const BaseInfo& b;
+		size_t cell; //rg * nq + q
+		int& q;
+		template<size_t I, typename Covariate>
+		inline void apply(){
+			long key = Covariate::key(b);
+			if(key >= 0 && (size_t)key < t.nkeys[I]){
+				q += t.dqs[I][cell * t.nkeys[I] + key];
+			}
+		}
+	};
+public:
+	RecalibrationTable(){}
+	RecalibrationTable(const dq_t& model, int minqual = 6);
+	//write the recalibrated qualities of a read of length len into out. seq must have a
+	//code(i) method giving the 2-bit code of base i, or 4 for an N (see readutils::PackedSeq).
+	//out may be the same buffer as qual.
+	template<typename Seq>
+	void recalibrate(int rg, bool second, const Seq& seq, const uint8_t* qual, size_t len, uint8_t* out) const{
+		if(rg < 0 || rg >= nrg){
+			for(size_t i = 0; i < len; ++i){
+				out[i] = clamp(qual[i]);
+			}
+			return;
+		}
+		const int16_t* rgbase = &base[(size_t)rg * nq];
+		BaseInfo b;
+		b.second = second;
+		for(size_t i = 0; i < len; ++i){
+			b.cycle = i;
+			b.push(seq.code(i));
+			b.q = qual[i];
+			b.lowq = b.q < minqual;
+			if(b.q >= nq || rgbase[b.q] == untrained){
+				out[i] = clamp(b.q);
+				continue;
+			}
+			int recalibrated = rgbase[b.q];
+			AddDq add{*this, b, (size_t)rg * nq + b.q, recalibrated};
+			ForEachCovariate<model_covariates>::apply(add);
+			out[i] = clamp(recalibrated);
+		}
+	}
 };
 
 typedef std::vector<int> prior1_t; //1 prior for each rg
@@ -44,6 +287,54 @@ public:
 	static long double get_normal_prior(size_t j);
 };
 
+//find the maximum a posteriori quality of a cell with the given counts, trying every
+//quality from 0 to KBBQ_MAXQ. the likelihood is binomial with +1/+2 pseudocounts and
+//the prior is a normal centered at prior.
+int map_q(unsigned long long errors, unsigned long long total, int prior);
+
+//the counts of one cell of a covariate and the prior quality to fit it with.
+struct map_cell_t{
+	unsigned long long errors;
+	unsigned long long total;
+	int prior;
+	int map_q; //filled in by MAPFitter::fit
+};
+
+//fits map_q for many cells at once. the log-probability and prior terms are tabulated
+//up front, so scoring a candidate quality is a few multiply-adds with no transcendental
+//calls. the log posterior is concave in q, so rather than scoring every candidate the
+//fitter searches from the empirical quality for the point where it stops rising. if any
+//comparison along the way is too close for double precision to make the same way map_q
+//would, every candidate is scored, and if the best two are still too close the cell is
+//refit with map_q, so the result is always identical to map_q.
+class MAPFitter{
+protected:
+	static const int nq = KBBQ_MAXQ + 1;
+	static const int prior_offset = 256; //priors in [-prior_offset, prior_offset] are tabulated
+	std::array<double, nq> logp;
+	std::array<double, nq> log1mp;
+	std::vector<double> normal_prior; //normal_prior[prior_offset + i] is the prior for |i|
+	bool validate;
+	//the search; falls back to scan_q when it can't be sure of a comparison.
+	int search_q(unsigned long long errors, unsigned long long total, int prior) const;
+	//score every candidate; falls back to map_q when the best two are too close.
+	int scan_q(unsigned long long errors, unsigned long long total, int prior) const;
+	//search_q, checked against scan_q when validate is set.
+	int fit_one(unsigned long long errors, unsigned long long total, int prior) const;
+public:
+	//with validate set, every search is checked against the exhaustive scan and a
+	//std::logic_error is thrown if they disagree. debug builds validate by default.
+#ifdef NDEBUG
+	static const bool validate_by_default = false;
+#else
+	static const bool validate_by_default = true;
+#endif
+	MAPFitter(bool validate = validate_by_default);
+	//fill in map_q of every cell, splitting the cells between nthreads threads.
+	//an error thrown while fitting is rethrown here once every thread has finished.
+	void fit(std::vector<map_cell_t>& cells, int nthreads = 1) const;
+};
+
 /*
 def _logpmf(self, x, n, p):
     k = floor(x)
@@ -109,6 +400,8 @@ public:
 	CCovariate(size_t len): std::vector<covariate_t>(len) {}
 	void increment(size_t idx, covariate_t value);
 	void increment(size_t idx, unsigned long long err, unsigned long long total);
+	//add the counts in other, growing to fit them.
+	void add(const CCovariate& other);
 };
 
 class CRGCovariate: public CCovariate
@@ -116,8 +409,7 @@ class CRGCovariate: public CCovariate
 public:
 	CRGCovariate(){}
 	CRGCovariate(size_t len): CCovariate(len){}
-	void consume_read(const readutils::CReadData& read);
-	rgdq_t delta_q(prior1_t prior);
+	rgdq_t delta_q(prior1_t prior, int nthreads = 1, const MAPFitter& fitter = MAPFitter());
 };
 
 class CQCovariate: public std::vector<CCovariate>
@@ -125,50 +417,55 @@ class CQCovariate: public std::vector<CCovariate>
 public:
 	CQCovariate(){}
 	CQCovariate(size_t rgs, size_t qlen): std::vector<CCovariate>(rgs, CCovariate(qlen)){}
-	void consume_read(const readutils::CReadData& read);
-	qscoredq_t delta_q(prior1_t prior);
-};
-
-typedef std::array<CCovariate,2> cycle_t;
-
-//The first Covariate is for fwd reads, the 2nd Covariate is for reverse reads.
-class CCycleCovariate: public std::vector<std::vector<cycle_t>>
-{
-public:
-	CCycleCovariate(){}
-	CCycleCovariate(size_t rgs, size_t qlen, size_t cylen):
-		std::vector<std::vector<cycle_t>>(rgs, std::vector<cycle_t>(qlen, cycle_t({CCovariate(cylen),CCovariate(cylen)})))
-		{}
-	void consume_read(const readutils::CReadData& read);
-	cycledq_t delta_q(prior2_t prior);
+	qscoredq_t delta_q(prior1_t prior, int nthreads = 1, const MAPFitter& fitter = MAPFitter());
 };
 
-class CDinucCovariate: public std::vector<std::vector<CCovariate>>
+//the totals of a covariate in model_covariates, for each rg -> q -> key.
+class CKeyedCovariate: public std::vector<std::vector<CCovariate>>
 {
 public:
-	CDinucCovariate(){}
-	CDinucCovariate(size_t rgs, size_t qlen, size_t dilen):
-		std::vector<std::vector<CCovariate>>(rgs, std::vector<CCovariate>(qlen, CCovariate(dilen)))
-		{}
-	void consume_read(const readutils::CReadData& read, int minscore = 6);
-	dinucdq_t delta_q(prior2_t prior);
+	CKeyedCovariate(){}
+	//add the counts in other, growing to fit them.
+	void add(const CKeyedCovariate& other);
+	keydq_t delta_q(prior2_t prior, int nthreads = 1, const MAPFitter& fitter = MAPFitter());
 };
 
+//the covariates are totals of 64-bit counts. reads are first counted in dense arrays of
+//32-bit counters, indexed by rg, q, then the covariate's key, so consuming a read is
+//one pass with a few increments per base no matter how many covariates there are.
+//the counters are added to the totals by flush(), which also happens before any
+//counter could overflow.
 class CCovariateData
 {
-// protected:
-// 	CRGCovariate rgcov;
-// 	CQCovariate qcov;
-// 	CCycleCovariate cycov;
-// 	CDinucCovariate dicov;
+protected:
+	//[errors, total] pairs
+	std::vector<uint32_t> qcounts; //rg -> q
+	std::array<std::vector<uint32_t>, ncovariates> counts; //rg -> q -> key, for each covariate
+	std::array<size_t, ncovariates> nkeys{};
+	size_t nrg = 0;
+	size_t nq = 0;
+	size_t ncycle = 0;
+	int max_rg = -1; //the largest rg consumed since the last flush
+	unsigned long long pending = 0; //bases consumed since the last flush
+	//flush, then make room for at least rgs read groups, qs quality scores and cycles cycles.
+	void grow(size_t rgs, size_t qs, size_t cycles);
+	struct CountBase;
+	struct SetKeys;
 public:
 	CRGCovariate rgcov;
 	CQCovariate qcov;
-	CCycleCovariate cycov;
-	CDinucCovariate dicov;
+	std::array<CKeyedCovariate, ncovariates> covariates; //in the order of model_covariates
 	CCovariateData(){};
 	void consume_read(readutils::CReadData& read, int minscore = 6);
-	dq_t get_dqs();
+	//add the counts of the reads consumed since the last flush to the covariates.
+	//call this before reading them; get_dqs calls it itself.
+	void flush();
+	//add the counts in other to these, as if this had also consumed every read other did.
+	//both are flushed first.
+	void merge(CCovariateData& other);
+	//fit the model, spreading the cells of each covariate between nthreads threads.
+	//with validate set, every fit is checked as described in MAPFitter.
+	dq_t get_dqs(int nthreads = 1, bool validate = MAPFitter::validate_by_default);
 };
 
 }
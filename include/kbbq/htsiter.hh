@@ -31,21 +31,53 @@ static_assert(HTS_VERSION >= 101000, "Your version of htslib is out of date. KBB
 //fwd declare
 namespace readutils{
 	class CReadData;
+	class ReadGroups;
 	std::string bam_seq_str(bam1_t* bamrecord);
 }
 
+namespace covariateutils{
+	class RecalibrationTable;
+}
+
 //unsigned char* s = bam_get_seq(bamrecord);
 namespace htsiter{
 
 class HTSFile{
 public:
+	//the read groups of the run; shared by every file so read group ids agree.
+	readutils::ReadGroups& rgs;
+	HTSFile(readutils::ReadGroups& rgs): rgs(rgs){}
 	virtual ~HTSFile(){}
 	virtual int next()=0;
 	virtual std::string next_str()=0;
 	virtual readutils::CReadData get()=0;
-	virtual void recalibrate(const std::vector<uint8_t>& qual)=0;
+	//refill read from the current record, reusing its buffers.
+	virtual void get(readutils::CReadData& read)=0;
+	//fill the slots in reads with the next reads in the file, reusing their buffers.
+	//return the number of reads filled; this is less than reads.size() at the end of the file.
+	size_t get_batch(std::vector<readutils::CReadData>& reads);
+	//replace kmers with every kmer in the current read in the forward orientation.
+	//kmers[i] ends at base i+k-1; kmers containing an N are included but not valid.
+	virtual void get_kmers(std::vector<bloom::Kmer>& kmers, int k)=0;
+	//append the encoded (see Kmer::get) kmers at the given increasing indices of the list
+	//above to kmers. kmers that aren't valid are skipped.
+	virtual void append_kmers(std::vector<uint64_t>& kmers, int k, const std::vector<size_t>& idx)=0;
+	//the length of the current read sequence
+	virtual size_t seq_len()=0;
+	//replace qual with the qualities of the current read in the forward orientation.
+	//this doesn't copy anything else from the record.
+	virtual void get_qual(std::vector<uint8_t>& qual)=0;
+	//recalibrate the qualities of the current record in place. only the qualities, read group,
+	//mate and sequence are read from the record; nothing else is decoded or copied.
+	virtual void recalibrate(const covariateutils::RecalibrationTable& table)=0;
 	virtual int open_out(std::string filename)=0; //open an output file so it can be written to later.
 	virtual int write()=0; //write the current read to the opened file.
+protected:
+	//the last read group seen and its id. reads from the same group tend to
+	//come together, so most reads skip the hash lookup.
+	std::string last_rg;
+	int last_rgid = -1;
+	int rg_int(const char* rg, size_t len);
 };
 
 class BamFile: public HTSFile{
@@ -59,14 +91,15 @@ public:
 	bool use_oq;
 	bool set_oq;
 	htsThreadPool* tp;
-	BamFile(std::string filename, htsThreadPool* tp, bool use_oq = false, bool set_oq = false):
-		use_oq(use_oq), set_oq(set_oq), tp(tp){
+	BamFile(std::string filename, htsThreadPool* tp, readutils::ReadGroups& rgs, bool use_oq = false, bool set_oq = false):
+		HTSFile(rgs), use_oq(use_oq), set_oq(set_oq), tp(tp){
 		r = bam_init1();
 		sf = sam_open(filename.c_str(), "r");
 		if(tp->pool && hts_set_thread_pool(sf, tp) != 0){
 			std::cerr << "Couldn't attach thread pool to file " << filename << std::endl;
 		};
 	    h = sam_hdr_read(sf);
+	    this->load_header_rgs();
 	    //TODO: support iteration with index?
 	    // idx = sam_index_load(sf, filename.c_str());
 	   	//TODO: throw when index can't be found
@@ -89,13 +122,26 @@ public:
 	std::string next_str();
 	//
 	readutils::CReadData get();
-	//
-	void recalibrate(const std::vector<uint8_t>& qual);
+	void get(readutils::CReadData& read);
+	//fill kmers from the packed sequence without converting it to a string
+	void get_kmers(std::vector<bloom::Kmer>& kmers, int k);
+	void append_kmers(std::vector<uint64_t>& kmers, int k, const std::vector<size_t>& idx);
+	inline size_t seq_len(){return this->r->core.l_qseq;}
+	void get_qual(std::vector<uint8_t>& qual);
+	//if set_oq is set, the qualities in the record are saved to the OQ tag first.
+	void recalibrate(const covariateutils::RecalibrationTable& table);
 	// TODO:: add a PG tag to the header
 	int open_out(std::string filename);
 	//
 	int write();
-	//
+	//add the read groups in the header to rgs so their ids follow the header order.
+	void load_header_rgs();
+protected:
+	//buffers for recalibrate, kept between reads so it doesn't allocate.
+	std::vector<uint8_t> qbuf;
+	std::vector<char> oqbuf;
+	//copy the qualities in the record to the OQ tag.
+	void set_oq_tag();
 }; //end of BamFile class
 
 class FastqFile: public HTSFile
@@ -105,7 +151,7 @@ public:
 	kseq::kseq_t* r;
 	BGZF* ofh;
 	htsThreadPool* tp;
-	FastqFile(std::string filename, htsThreadPool* tp): ofh(NULL), tp(tp){
+	FastqFile(std::string filename, htsThreadPool* tp, readutils::ReadGroups& rgs): HTSFile(rgs), ofh(NULL), tp(tp){
 		fh = bgzf_open(filename.c_str(),"r");
 		if(tp->pool && bgzf_thread_pool(fh, tp->pool, tp->qsize) < 0){
 			std::cerr << "Couldn't attach thread pool to file " << filename << std::endl;
@@ -120,7 +166,12 @@ public:
 	int next();
 	std::string next_str();
 	readutils::CReadData get();
-	void recalibrate(const std::vector<uint8_t>& qual);
+	void get(readutils::CReadData& read);
+	void get_kmers(std::vector<bloom::Kmer>& kmers, int k);
+	void append_kmers(std::vector<uint64_t>& kmers, int k, const std::vector<size_t>& idx);
+	inline size_t seq_len(){return this->r->seq.l;}
+	void get_qual(std::vector<uint8_t>& qual);
+	void recalibrate(const covariateutils::RecalibrationTable& table);
 	int open_out(std::string filename);
 	int write();
 };
@@ -129,32 +180,40 @@ class KmerSubsampler{
 public:
 	HTSFile* file;
 	minion::Random rng;
-	std::bernoulli_distribution d;
-	std::string readseq = "";
-	std::vector<bloom::Kmer> kmers;
-	bloom::Kmer kmer;
-	size_t cur_kmer = 0;
+	double alpha;
+	std::vector<size_t> sampled_idx; //indices of the sampled kmers in the current read
 	size_t total_kmers = 0;
+	size_t skip = 0; //the number of kmers to pass over before the next sampled one
+	uint64_t seed;
+	uint64_t read_ordinal = 0; //index of the next read in the file. set to sample a shard of the file.
 	bool not_eof = true;
 	int k;
 	KmerSubsampler(HTSFile* file): KmerSubsampler(file, KBBQ_MAX_KMER){}
 	KmerSubsampler(HTSFile* file, int k): KmerSubsampler(file, k, .15){}
 	KmerSubsampler(HTSFile* file, int k, double alpha): KmerSubsampler(file, k, alpha,  minion::create_seed_seq().GenerateOne()){}
-	KmerSubsampler(HTSFile* file, int k, double alpha, uint64_t seed): file(file), k(k), kmer(k), d(alpha) {rng.Seed(seed); std::cerr << "p: " << d.p() << std::endl;} //todo remove srand
-	
-	//return the next kmer
-	//once the file is finished iterating and there are no remaining kmers,
-	//return an empty kmer. You should check the not_eof flag.
-	//the kmer returned is not guaranteed to be valid.
-	bloom::Kmer next_kmer();
-
-	//return the next kmer that survives sampling.
-	//it is not gauranteed to be valid.
-	bloom::Kmer next();
-	inline bloom::Kmer operator()() {return this->next();}
+	KmerSubsampler(HTSFile* file, int k, double alpha, uint64_t seed): file(file), alpha(alpha), seed(seed), k(k){
+		std::cerr << "p: " << alpha << std::endl;
+#ifdef KBBQ_USE_RAND_SAMPLER
+		skip = draw_skip(); //the sequential sampler carries skip across reads; otherwise next_batch draws it
+#endif
+	}
+
+	//seed the rng with a keyed hash of the seed and the read ordinal. the kmers sampled
+	//from a read then don't depend on which reads were sampled before it, so disjoint
+	//ranges of reads can be sampled independently and give the same result.
+	void seed_read(uint64_t ordinal);
+
+	//draw the number of kmers that fail sampling before the next success.
+	//this is geometric with p = alpha, which is the same as drawing a bernoulli for every kmer.
+	size_t draw_skip();
+
+	//replace the contents of kmers with the encoded, valid kmers sampled from the next
+	//reads. whole reads are consumed until there are at least batch_size kmers or the
+	//file is finished, so kmers holds at most batch_size plus one read's worth of kmers.
+	//return the number of kmers; 0 once the file is finished.
+	size_t next_batch(std::vector<uint64_t>& kmers, size_t batch_size = 4096);
 	inline explicit operator bool() const{return not_eof;}
 };
-
 }
 
 #endif
@@ -2,8 +2,10 @@
 #define READUTILS_H
 
 #include <vector>
+#include <array>
 #include <unordered_map>
 #include <string>
+#include <mutex>
 #include <errno.h>
 //
 #include <htslib/sam.h>
@@ -18,6 +20,7 @@
 //fwd declare
 namespace covariateutils{
 	struct dq_t;
+	class RecalibrationTable;
 }
 
 namespace readutils{
@@ -41,35 +44,247 @@ namespace readutils{
 		return seq;
 	}
 
+	//iterate over the kmers of a read in the forward orientation, reading the
+	//4-bit encoded sequence directly instead of converting it to a string first.
+	//reverse reads are walked from the end of the record and complemented.
+	//to use: while(it.next()){//do something with *it}
+	//the kmer is only valid once k consecutive non-N bases have been seen.
+	class BamKmerIterator{
+	protected:
+		const uint8_t* s;
+		bool rev;
+		size_t len;
+		size_t i;
+		bloom::Kmer kmer;
+	public:
+		BamKmerIterator(const bam1_t* bamrecord, int k): s(bam_get_seq(bamrecord)),
+			rev(bam_is_rev(bamrecord)), len(bamrecord->core.l_qseq), i(0), kmer(k) {}
+		//add the next base to the kmer; return false if there are no more bases.
+		inline bool next(){
+			if(i >= len){return false;}
+			int c = seq_nt16_int[bam_seqi(s, rev ? len - 1 - i : i)];
+			kmer.push_back_int(rev && c < 4 ? 3 - c : c);
+			++i;
+			return true;
+		}
+		//the index of the last base added in the forward orientation
+		inline size_t pos() const{return i - 1;}
+		inline const bloom::Kmer& operator*() const{return kmer;}
+		inline const bloom::Kmer* operator->() const{return &kmer;}
+	};
+
+	//a read-only view of a bam record in the forward orientation of the read.
+	//the sequence and qualities are read from the record's buffers; nothing is copied.
+	//the view is invalidated when the record is overwritten.
+	class BamReadView{
+	protected:
+		const bam1_t* r;
+		const uint8_t* s;
+		const uint8_t* q;
+		uint8_t qoffset; //33 when the qualities come from the OQ tag
+		size_t len;
+		bool rev;
+		mutable const char* rgtag = NULL;
+	public:
+		//throws std::invalid_argument if use_oq is set and the OQ tag can't be read.
+		BamReadView(const bam1_t* bamrecord, bool use_oq = false);
+		inline size_t length() const{return len;}
+		//the 2-bit code of base i, or 4 if it is an N.
+		inline int code(size_t i) const{
+			int c = seq_nt16_int[bam_seqi(s, rev ? len - 1 - i : i)];
+			return rev && c < 4 ? 3 - c : c;
+		}
+		inline uint8_t qual(size_t i) const{return q[rev ? len - 1 - i : i] - qoffset;}
+		inline const char* name() const{return bam_get_qname(r);}
+		inline bool second() const{return r->core.flag & BAM_FREAD2;}
+		//the RG tag. throws std::invalid_argument if it can't be read.
+		const char* rg() const;
+	};
+
+	//a read sequence packed 2 bits per base (A=0, C=1, G=2, T=3) with a separate
+	//mask of the positions holding an N (or any other non-ACGT base).
+	class PackedSeq{
+	protected:
+		std::vector<uint64_t> bases; //32 bases per word
+		std::vector<uint64_t> nmask; //64 positions per word
+		size_t len = 0;
+	public:
+		PackedSeq(){}
+		PackedSeq(const std::string& s){this->assign(s.c_str(), s.length());}
+		//set the length to n. every base is set to A.
+		void reset(size_t n);
+		void assign(const char* s, size_t n);
+		inline size_t length() const{return len;}
+		inline size_t size() const{return len;}
+		//the 2-bit code of the base at i, or 4 if it is an N.
+		inline int code(size_t i) const{
+			return (nmask[i >> 6] >> (i & 63) & 1) ? 4 : (bases[i >> 5] >> ((i & 31) << 1) & 3);
+		}
+		inline char operator[](size_t i) const{return "ACGTN"[this->code(i)];}
+		inline void set_code(size_t i, int c){
+			size_t shift = (i & 31) << 1;
+			bases[i >> 5] = (bases[i >> 5] & ~(3ULL << shift)) | (uint64_t)(c & 3) << shift;
+			nmask[i >> 6] = (nmask[i >> 6] & ~(1ULL << (i & 63))) | (uint64_t)(c > 3) << (i & 63);
+		}
+		inline void set(size_t i, char c){this->set_code(i, seq_nt16_int[seq_nt16_table[c]]);}
+		//the packed bases and N mask. bits past the end of the sequence are 0.
+		inline const std::vector<uint64_t>& base_words() const{return bases;}
+		inline const std::vector<uint64_t>& n_words() const{return nmask;}
+		std::string str(size_t pos = 0, size_t count = std::string::npos) const;
+		//replace the contents of out with the sequence, reusing its buffer.
+		void str(std::string& out) const;
+		PackedSeq substr(size_t pos = 0, size_t count = std::string::npos) const;
+	};
+
+	//the read groups of a run, each with a dense integer id. every file read in a run
+	//shares one of these so the ids agree between passes. ids are never reassigned,
+	//so an id resolved once can be used from any thread; adding groups is locked.
+	class ReadGroups{
+	protected:
+		std::unordered_map<std::string, int> ids;
+		std::vector<std::string> names;
+		std::vector<std::string> pus;
+		mutable std::mutex mtx;
+		int insert(const std::string& rg, const std::string& pu);
+	public:
+		//get the id of rg, adding it if it hasn't been seen before.
+		inline int id(const std::string& rg){return this->insert(rg, rg);}
+		//add the read groups listed in a bam header, in order.
+		void load_from_header(sam_hdr_t* header);
+		size_t size() const;
+		std::string name(int id) const;
+		//the PU of the read group when it was listed in a header; otherwise the name.
+		std::string pu(int id) const;
+		//the id of the first read group with the given PU, or -1 if there isn't one.
+		//recalibration reports name read groups this way.
+		int find_pu(const std::string& pu) const;
+	};
+
+	//the fields of a fastq header that kbbq uses, found in a single scan of the
+	//record's name and comment. the pointers refer to the record's buffers.
+	class FastqHeader{
+	protected:
+		bool set_rg(const char* field, const char* field_end);
+	public:
+		const char* name; //the first field of the name
+		size_t name_len;
+		int mate; //1 or 2 if the first field ends in /1 or /2; 0 otherwise
+		const char* rg; //the value of the first RG: field; empty if there isn't one
+		size_t rg_len;
+		FastqHeader(const kseq::kseq_t* fastqrecord, const std::string& namedelimiter = "_");
+	};
+
+	//working memory for CReadData::get_errors. the buffers keep their capacity
+	//between reads, so once they've grown to fit the longest read, correction
+	//doesn't allocate. use one per thread.
+	struct CorrectionScratch{
+		std::string seq; //the read being corrected
+		std::string original; //the read before correction
+		std::vector<char> fixes;
+		bloom::TrustedKmers kmers; //which kmers of seq are trusted
+		std::vector<bloom::Kmer> kmer_at; //the kmer starting at each base, with Ns read as A
+		std::vector<uint8_t> n_count; //the number of Ns in each of those kmers
+		bool quality_tie = false; //whether correction broke a tie between fixes by quality
+		std::vector<uint64_t> cache_key; //see ErrorCache
+	};
+
+	class CReadData;
+
+	//a bounded cache of the errors found in reads, so a read with the same sequence as one
+	//already corrected isn't corrected again. the errors of a read depend only on its
+	//sequence and which of its qualities are <= minqual, unless correction broke a tie
+	//between fixes by quality; those reads aren't cached. entries are direct-mapped by a
+	//hash of the key and replaced on collision. the whole key is compared, so a hit always
+	//gives the errors correction would have found. slots are locked in stripes, so one
+	//cache can be shared by every thread. use one cache per trusted filter, k and minqual.
+	class ErrorCache{
+	protected:
+		struct Entry{
+			uint64_t hash = 0;
+			size_t len = 0;
+			std::vector<uint64_t> key; //the bases, the N mask, then the low quality mask
+			std::vector<bool> errors;
+		};
+		struct Stripe{
+			mutable std::mutex mtx;
+			unsigned long long hits = 0;
+			unsigned long long misses = 0;
+			unsigned long long uncached = 0;
+		};
+		static const size_t nstripes = 64;
+		std::vector<Entry> entries;
+		std::array<Stripe, nstripes> stripes;
+		int minqual;
+		void make_key(const CReadData& read, std::vector<uint64_t>& key) const;
+	public:
+		//a cache of size reads. with size 0 nothing is cached.
+		ErrorCache(size_t size, int minqual = 6);
+		//fill the errors attribute of read from the cache if it's there; otherwise find them
+		//with CReadData::get_errors and cache them.
+		const std::vector<bool>& get_errors(CReadData& read, const bloom::Bloom& trusted, int k);
+		//reads found in the cache
+		unsigned long long hits() const;
+		//reads that had to be corrected
+		unsigned long long misses() const;
+		//misses that couldn't be cached because their errors depend on their qualities
+		unsigned long long uncached() const;
+	};
+
 	class CReadData{
 		public:
-			static std::unordered_map<std::string, std::string> rg_to_pu;
-			static std::unordered_map<std::string, int> rg_to_int;
 			CReadData(){}
-			CReadData(bam1_t* bamrecord, bool use_oq = false);
+			CReadData(bam1_t* bamrecord, ReadGroups& rgs, bool use_oq = false);
 			// hello?
-			CReadData(kseq::kseq_t* fastqrecord, std::string rg = "", int second = 2, std::string namedelimiter = "_");
-			std::string seq;
+			CReadData(kseq::kseq_t* fastqrecord, ReadGroups& rgs, std::string rg = "", int second = 2, std::string namedelimiter = "_");
+			//refill this read from a record. the buffers keep their capacity, so one
+			//CReadData can be reused for every read in a file without reallocating.
+			void fill(bam1_t* bamrecord, ReadGroups& rgs, bool use_oq = false);
+			//as above, with the id of view.rg() already resolved (see ReadGroups::id)
+			void fill(const BamReadView& view, int rgid);
+			void fill(kseq::kseq_t* fastqrecord, ReadGroups& rgs, std::string rg = "", int second = 2, std::string namedelimiter = "_");
+			//as above, with the header already parsed and the id of its read group resolved
+			void fill(kseq::kseq_t* fastqrecord, const FastqHeader& header, int rgid, int second = 2);
+			PackedSeq seq;
 			std::vector<uint8_t> qual;
 			std::vector<bool> skips;
 			std::string name;
 			std::string rg;
+			int rgid; //the id of rg in the run's ReadGroups, resolved when the read is filled
 			bool second;
 			std::vector<bool> errors;
 			std::string str_qual();
 			std::string canonical_name();
-			inline int get_rg_int() const{return this->rg_to_int[this->rg];}
-			inline std::string get_pu() const{return this->rg_to_pu[this->rg];}
+			inline int get_rg_int() const{return this->rgid;}
 			std::vector<bool> not_skipped_errors() const;
 			//fill errors attribute given sampled kmers and thresholds.
 			void infer_read_errors(const bloom::Bloom& b, const std::vector<int>& thresholds, int k);
+			//as above, using kmers already extracted from the read (see HTSFile::get_kmers)
+			void infer_read_errors(const std::vector<bloom::Kmer>& kmers, const bloom::Bloom& b, const std::vector<int>& thresholds, int k);
+			//fill errors attribute given the output of bloom::overlapping_kmers_in_bf
+			void infer_read_errors(const std::array<std::vector<size_t>,2>& overlapping, const std::vector<int>& thresholds, int k);
 			//fix one error and return the index of the fixed base; std::string::npos if no fixes are found
 			size_t correct_one(const bloom::Bloom& t, int k);
-			static void load_rgs_from_bamfile(bam_hdr_t* header);
-			//fill errors attribute given trusted kmers
-			std::vector<bool> get_errors(const bloom::Bloom& trusted, int k, int minqual = 6, bool first_call = true);
-			std::vector<uint8_t> recalibrate(const covariateutils::dq_t& dqs, int minqual = 6) const;
+			//as above, for a sequence of length len with qualities qual. seq is modified in place.
+			static size_t correct_one(char* seq, size_t len, const uint8_t* qual, const bloom::Bloom& t, int k);
+			//as above, with the given scratch space
+			static size_t correct_one(char* seq, size_t len, const uint8_t* qual, const bloom::Bloom& t, int k,
+				CorrectionScratch& scratch);
+			//fill errors given the output of bloom::overlapping_kmers_in_bf and the read's qualities.
+			//errors must be the same size as qual.
+			static void infer_errors(const std::array<std::vector<size_t>,2>& overlapping, const std::vector<uint8_t>& qual,
+				const std::vector<int>& thresholds, int k, std::vector<bool>& errors);
+			//fill errors attribute given trusted kmers, using a scratch space for the calling thread.
+			//seq isn't modified.
+			const std::vector<bool>& get_errors(const bloom::Bloom& trusted, int k, int minqual = 6, bool first_call = true);
+			//as above, with the given scratch space
+			const std::vector<bool>& get_errors(const bloom::Bloom& trusted, int k, CorrectionScratch& scratch, int minqual = 6, bool first_call = true);
+			//write the recalibrated qualities into out, which must hold seq.length() values.
+			void recalibrate(const covariateutils::RecalibrationTable& table, uint8_t* out) const;
 			CReadData substr(size_t pos = 0, size_t count = std::string::npos) const;
+		protected:
+			//find the errors in [offset, offset+len) of the sequence in scratch.seq, treating it as its own read.
+			void find_errors(const bloom::Bloom& trusted, int k, int minqual, bool first_call,
+				size_t offset, size_t len, CorrectionScratch& scratch);
 
 	};
 }
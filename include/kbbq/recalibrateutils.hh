@@ -23,6 +23,10 @@ namespace htsiter{
 	class HTSFile;
 }
 
+namespace readutils{
+	class ErrorCache;
+}
+
 namespace recalibrateutils{
 
 //subsample kmers, hash them, and add them to the bloom filter
@@ -36,9 +40,12 @@ void find_trusted_kmers(htsiter::HTSFile* file, bloom::Bloom& trusted,
 inline long double q_to_p(int q){return std::pow(10.0l, -((long double)q / 10.0l));}
 inline int p_to_q(long double p, int maxscore = 42){return p > 0 ? (int)(-10 * std::log10(p)) : maxscore;}
 
-//get covariate data using the trusted kmers
-//this can be parallelized easily since each read is independent
-covariateutils::CCovariateData get_covariatedata(htsiter::HTSFile* file, const bloom::Bloom& trusted, int k);
+//get covariate data using the trusted kmers.
+//with more than 1 thread, each thread takes batches of reads from the file and counts
+//them on its own; the counts are merged at the end, so the result doesn't depend on
+//the number of threads. with a cache, reads already corrected aren't corrected again.
+covariateutils::CCovariateData get_covariatedata(htsiter::HTSFile* file, const bloom::Bloom& trusted, int k, int nthreads = 1,
+	readutils::ErrorCache* cache = nullptr);
 
 //recalibrate all reads given the CovariateData
 void recalibrate_and_write(htsiter::HTSFile* in, const covariateutils::dq_t& dqs, std::string outfn);
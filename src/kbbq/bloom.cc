@@ -25,28 +25,50 @@ namespace bloom
 
 	Bloom::~Bloom(){}
 
+	void Bloom::insert_batch(const std::vector<uint64_t>& kmers){
+		static const size_t lookahead = 8;
+		std::array<std::pair<size_t,size_t>, lookahead> locs;
+		for(size_t i = 0; i < kmers.size() + lookahead; ++i){
+			if(i >= lookahead){
+				bloom.insert_at(locs[i % lookahead]);
+			}
+			if(i < kmers.size()){
+				locs[i % lookahead] = bloom.locate(kmers[i]);
+				bloom.prefetch(locs[i % lookahead]);
+			}
+		}
+	}
+
 	std::array<std::vector<size_t>,2> overlapping_kmers_in_bf(std::string seq, const Bloom& b, int k){
 		bloom::Kmer kmer(k);
-		std::vector<bool> kmer_present(seq.length()-k+1, false);
-		std::vector<size_t> kmers_in(seq.length(), 0);
-		std::vector<size_t> kmers_possible(seq.length(), 0);
-		size_t incount = 0;
-		size_t outcount = 0;
+		std::vector<Kmer> kmers;
 		for(size_t i = 0; i < seq.length(); ++i){
 			kmer.push_back(seq[i]);
 			if(i >= k-1){
-				kmer_present[i-k+1] = kmer.valid() ? b.query(kmer) : false;
+				kmers.push_back(kmer);
 			}
 #ifndef NDEBUG
-			// if(i >= k-1){std::cerr << kmer << " " << kmer_present[i-k+1] << std::endl;}
+			// if(i >= k-1){std::cerr << kmer << " " << b.query(kmer) << std::endl;}
 			if(i >= k-1 && seq == "AAGTGGGTTTCTCAGTATTTTATTCTTTTGATATTATCATACATGATACTATCGTCTTGATTTCTTCTTCAGAGAGTTTATTGTTGTTGTAGAAATACAATTGATTTTTGTGTATTGATTTTGTATCCTGCAGCTTTGCTGAATTTTATTT"){
 				std::string kmerstr(seq, i-k+1, k);
-				std::cerr << kmerstr << " " << kmer_present[i-k+1] << std::endl;
+				std::cerr << kmerstr << " " << b.query(kmer) << std::endl;
 			}
 #endif
 		}
-		for(size_t i = 0; i < seq.length(); ++i){
-			if(i < seq.length() - k + 1){ //add kmers now in our window
+		return overlapping_kmers_in_bf(kmers, seq.length(), b, k);
+	}
+
+	std::array<std::vector<size_t>,2> overlapping_kmers_in_bf(const std::vector<Kmer>& kmers, size_t len, const Bloom& b, int k){
+		std::vector<bool> kmer_present(len-k+1, false);
+		std::vector<size_t> kmers_in(len, 0);
+		std::vector<size_t> kmers_possible(len, 0);
+		size_t incount = 0;
+		size_t outcount = 0;
+		for(size_t i = 0; i < kmers.size(); ++i){
+			kmer_present[i] = kmers[i].valid() ? b.query(kmers[i]) : false;
+		}
+		for(size_t i = 0; i < len; ++i){
+			if(i < len - k + 1){ //add kmers now in our window
 				if(kmer_present[i]){
 					++incount;
 				} else {
@@ -81,19 +103,18 @@ namespace bloom
 	}
 
 	char get_next_trusted_char(const Kmer& kmer, const Bloom& trusted, bool reverse_test_order){
-		const std::array<char, 4> test_bases = !reverse_test_order ?
-			std::array<char, 4>{'A','C','G','T'}: std::array<char, 4>{'T','G','C','A'};
-		for(const char& c: test_bases){
-			Kmer extra = kmer;
-			extra.push_back(c);
-			if(trusted.query(extra)){
-				return c;
+		const std::array<int, 4> test_bases = !reverse_test_order ?
+			std::array<int, 4>{0,1,2,3}: std::array<int, 4>{3,2,1,0};
+		uint8_t trusted_mask = trusted.query_successors(kmer);
+		for(const int& c: test_bases){
+			if(trusted_mask & (1 << c)){
+				return "ACGT"[c];
 			}
 		}
 		return 0;
 	}
 
-	std::array<size_t, 2> find_longest_trusted_seq(std::string seq, const Bloom& b, int k){
+	std::array<size_t, 2> find_longest_trusted_seq(SeqView seq, const Bloom& b, int k){
 		Kmer kmer(k);
 		size_t anchor_start, anchor_end, anchor_best, anchor_current;
 		anchor_start = anchor_end = std::string::npos;
@@ -127,64 +148,91 @@ namespace bloom
 		return std::array<size_t,2>{{anchor_start, anchor_end}};
 	}
 
-	std::tuple<std::vector<char>,size_t,bool> find_longest_fix(std::string seq, const Bloom& trusted, int k, bool reverse_test_order){
+	std::array<size_t, 2> find_longest_trusted_seq(const TrustedKmers& kmers, size_t offset, size_t len, int k){
+		size_t anchor_start, anchor_end, anchor_best;
+		anchor_start = anchor_end = std::string::npos;
+		anchor_best = 0;
+		if(len < k){
+			return std::array<size_t,2>{{anchor_start, anchor_end}};
+		}
+		size_t end = offset + len - k + 1; //one past the last kmer
+		size_t run_start = kmers.next_set(offset, end);
+		while(run_start < end){
+			size_t run_end = kmers.next_unset(run_start, end);
+			if(run_end - run_start > anchor_best){
+				anchor_best = run_end - run_start;
+				anchor_start = run_start - offset;
+				//the last base of the last trusted kmer
+				anchor_end = run_end == end ? std::string::npos : run_end - offset + k - 2;
+			}
+			run_start = kmers.next_set(run_end, end);
+		}
+		return std::array<size_t,2>{{anchor_start, anchor_end}};
+	}
+
+	std::pair<size_t,bool> find_longest_fix(SeqView seq, const Bloom& trusted, int k, std::vector<char>& best_c, bool reverse_test_order,
+		const TrustedKmersView* known)
+	{
 #ifndef NDEBUG
-		std::cerr << seq << std::endl;
+		std::cerr << seq.str() << std::endl;
 #endif
 		Kmer kmer(k);
-		std::vector<char> best_c{};
+		best_c.clear();
 		size_t best_i = 0;
 		bool single = false; //this pair of flags will be used to determine whether
 		bool multiple = false; //multiple corrections were considered
 		char unfixed_char = seq[k-1];
 		const std::array<char,4> test_bases = !reverse_test_order ?
 			std::array<char, 4>{'A','C','G','T'}: std::array<char, 4>{'T','G','C','A'};
+		//the first k-1 bases are shared by every fix, so they're only added once.
+		//which fixes make the first kmer trusted; the rest can't extend past k-1.
+		for(size_t i = 0; i < k-1; ++i){
+			kmer.push_back(seq[i]);
+		}
+		uint8_t first_trusted = trusted.query_successors(kmer);
 		for(const char& c: test_bases){
 			if(c == unfixed_char){continue;}
-			seq[k-1] = c;
-			kmer.reset();
-			size_t i;
-			size_t i_stop = std::max((size_t)2*k-1, seq.length()); //2k-1 -> 2k?
-			for(i = 0; i < i_stop; ++i){ //i goes to max(2*k-1, seq.length())
-				char n = i < seq.length() ? seq[i] : get_next_trusted_char(kmer, trusted, reverse_test_order);
-				if(n == 0){ // no next trusted kmer
-					break;
-				}
-				kmer.push_back(n);
-				if(i >= k-1){
-					// std::cerr << kmer.size() << std::endl;
-					if(kmer.valid()){
-#ifndef NDEBUG
-						std::cerr << std::string(kmer) << " " << i << " " << trusted.query(kmer) << std::endl;
-#endif
-						if(!trusted.query(kmer)){
-							break;
-						} else { //we have a trusted kmer with this fix
-							if(i == k-1){ //the first possible trusted kmer
-								if(single){multiple = true;} //if we had one already, set multiple
-								single = true;
-							}
-						}
-					} else { //a non-ATCG base must've been added
+			size_t i = k-1; //if the first kmer isn't trusted, the fix ends there
+			Kmer fixed(kmer);
+			if(first_trusted & (1 << seq_nt16_int[seq_nt16_table[c]])){
+				if(single){multiple = true;} //if we had one already, set multiple
+				single = true;
+				fixed.push_back(c);
+				size_t i_stop = std::max((size_t)2*k-1, seq.length()); //2k-1 -> 2k?
+				for(i = k; i < i_stop; ++i){ //i goes to max(2*k-1, seq.length())
+					if(known != NULL && i == 2*k-1 && i < seq.length()){
+						//the remaining kmers don't contain the fix; skip to the first untrusted one.
+						i = known->next_untrusted(k, seq.length() - k + 1) + k - 1;
+						break;
+					}
+					char n = i < seq.length() ? seq[i] : get_next_trusted_char(fixed, trusted, reverse_test_order);
+					if(n == 0){ // no next trusted kmer
+						break;
+					}
+					//a non-ATCG base resets the kmer, so it won't be valid.
+					if(fixed.push_back(n) < k || !trusted.query(fixed)){
 						break;
 					}
+#ifndef NDEBUG
+					std::cerr << std::string(fixed) << " " << i << " 1" << std::endl;
+#endif
 				}
 			}
 			if(i > best_i){
 #ifndef NDEBUG
-				std::cerr << std::string(kmer) << " L" << std::endl;
+				std::cerr << std::string(fixed) << " L" << std::endl;
 #endif
 				best_c.clear();
 				best_c.push_back(c);
 				best_i = i;
 			} else if (i == best_i){
 #ifndef NDEBUG
-				std::cerr << std::string(kmer) << " T" << std::endl;
+				std::cerr << std::string(fixed) << " T" << std::endl;
 #endif
 				best_c.push_back(c);
 			}
 		}
-		return std::make_tuple(best_c, best_i, multiple);
+		return std::make_pair(best_i, multiple);
 	}
 
 	long double calculate_phit(const Bloom& bf, long double alpha){
@@ -205,7 +253,7 @@ namespace bloom
 	}
 
 	//ensure anchor >= k - 1 before this.
-	std::pair<size_t,bool> adjust_right_anchor(size_t anchor, std::string seq, const Bloom& trusted, int k){
+	std::pair<size_t,bool> adjust_right_anchor(size_t anchor, SeqView seq, const Bloom& trusted, int k){
 		Kmer kmer(k);
 		bool multiple = false; //multiple corrections were considered
 		size_t modified_idx = anchor + 1;
@@ -213,17 +261,18 @@ namespace bloom
 		for(size_t i = modified_idx - k + 1; i < modified_idx; ++i){
 			kmer.push_back(seq[i]);
 		}
-		for(const char& c : {'A','C','G','T'}){
-			if(seq[modified_idx] == c){continue;}
+		uint8_t trusted_mask = trusted.query_successors(kmer);
+		for(int c = 0; c < 4; ++c){
+			if(seq[modified_idx] == "ACGT"[c] || !(trusted_mask & (1 << c))){continue;}
 			bloom::Kmer new_kmer = kmer;
-			new_kmer.push_back(c);
+			new_kmer.push_back_int(c);
 			//if this fix works, we don't need to adjust the anchor if it fixes all remaining kmers.
 			//modified_idx + 1 to modified_idx + 1 + k - 1
 			for(size_t i = 0; i <= k; ++i){ //668188
 #ifndef NDEBUG
 				std::cerr << "i: " << i << " anchor + 2 + i: " << anchor + 2 + i << " len: " << seq.length() << std::endl;
 #endif
-				if(!trusted.query(new_kmer)){
+				if(i > 0 && !trusted.query(new_kmer)){ //the first kmer was checked with the mask
 					break;
 				}
 				//if we get to the end of the altered kmers and they're all fixed, the anchor is fine.
@@ -239,22 +288,26 @@ namespace bloom
 		} // if we make it through this loop, we need to adjust the anchor.
 		//we will test fixes starting with halfway through the last kmer to the end.
 		//how much we're winding back the anchor; anchor-i-k must be > 0.
-		for(int i = k/2-1; i >= 0 && anchor > i+k-1; --i){ 
+		//the k-1 bases before modified_idx slide right by one each time, so only
+		//the first k-2 are added up front and one more is added per step.
+		if(k/2-1 >= 0 && anchor > k/2-1+k-1){
 			kmer.reset();
-			modified_idx = anchor-i;
-			// size_t modified_idx = anchor+1-i+k-2;
-			// for(size_t j = anchor + 1 - i - k; j < anchor + 1 - i; ++j){ //start can be -1 from this
-			for(size_t j = modified_idx - k + 1; j < modified_idx; ++j){
+			for(size_t j = anchor - (k/2-1) - k + 1; j < anchor - (k/2-1) - 1; ++j){
 				kmer.push_back(seq[j]);
 			}
-			for(const char& c: {'A','C','G','T'}){
-				if(seq[modified_idx] == c){continue;}
+		}
+		for(int i = k/2-1; i >= 0 && anchor > i+k-1; --i){ 
+			modified_idx = anchor-i;
+			kmer.push_back(seq[modified_idx-1]);
+			trusted_mask = trusted.query_successors(kmer);
+			for(int c = 0; c < 4; ++c){
+				if(seq[modified_idx] == "ACGT"[c]){continue;}
 				bloom::Kmer new_kmer = kmer;
-				new_kmer.push_back(c);
+				new_kmer.push_back_int(c);
 #ifndef NDEBUG
-				std::cerr << "i: " << i << " modified_idx: " << modified_idx << " kmer:" << seq.substr(modified_idx-k+1,k-1) << c << std::endl;
+				std::cerr << "i: " << i << " modified_idx: " << modified_idx << " kmer:" << seq.substr(modified_idx-k+1,k-1).str() << "ACGT"[c] << std::endl;
 #endif
-				if(new_kmer.valid() && trusted.query(new_kmer)){
+				if(trusted_mask & (1 << c)){
 #ifndef NDEBUG
 					std::cerr << "Trusted!" << std::endl;
 #endif
@@ -276,7 +329,7 @@ namespace bloom
 		return std::make_pair(anchor, multiple);
 	}
 
-	int biggest_consecutive_trusted_block(std::string seq, const Bloom& trusted, int k, int current_len){
+	int biggest_consecutive_trusted_block(SeqView seq, const Bloom& trusted, int k, int current_len){
 		Kmer kmer(k);
 		int in = 0;
 		int out = 0;
@@ -1,4 +1,7 @@
 #include "covariateutils.hh"
+#include <thread>
+#include <stdexcept>
+#include <exception>
 
 namespace covariateutils{
 
@@ -18,190 +21,504 @@ namespace covariateutils{
 		return normal_prior[j];
 	}
 
-	void CCovariate::increment(size_t idx, covariate_t value){
-		this->increment(idx,value[0],value[1]);
+	namespace{
+		struct CovariateName{
+			size_t i;
+			std::string name;
+			template<size_t I, typename Covariate>
+			void apply(){if(I == i){name = Covariate::name();}}
+		};
+
+		struct CovariateKeyStr{
+			size_t i;
+			size_t key;
+			std::string str;
+			template<size_t I, typename Covariate>
+			void apply(){if(I == i){str = Covariate::key_str(key);}}
+		};
+
+		struct CovariateParseKey{
+			size_t i;
+			const char* s;
+			size_t len;
+			long key;
+			template<size_t I, typename Covariate>
+			void apply(){if(I == i){key = Covariate::parse_key(s, len);}}
+		};
 	}
 
-	void CCovariate::increment(size_t idx, unsigned long long err, unsigned long long total){
-		this->at(idx)[0] += err;
-		this->at(idx)[1] += total;
+	std::string covariate_name(size_t i){
+		CovariateName f{i, ""};
+		ForEachCovariate<model_covariates>::apply(f);
+		return f.name;
 	}
 
-	void CRGCovariate::consume_read(const readutils::CReadData& read){
-		int rg = read.get_rg_int();
-		if(this->size() <= rg){this->resize(rg+1);}
-		std::vector<bool> nse = read.not_skipped_errors();
-		this->increment(rg,
-			std::accumulate(nse.begin(), nse.end(), 0),
-			read.skips.size() - std::accumulate(read.skips.begin(), read.skips.end(), 0));
-		// for(size_t i = 0; i < read.skips.size(); ++i){
-		// 	if(!read.skips[i]){
-		// 		this->increment(rg, !!read.errors[i], 1);
-		// 	}
-		// }
+	std::string covariate_key_str(size_t i, size_t key){
+		CovariateKeyStr f{i, key, ""};
+		ForEachCovariate<model_covariates>::apply(f);
+		return f.str;
 	}
 
-	rgdq_t CRGCovariate::delta_q(meanq_t prior){
-		rgdq_t dq(this->size());
-		for(int i = 0; i < this->size(); ++i){ //i is rgs here
-			int map_q = 0; //maximum a posteriori q
-			long double best_posterior = std::numeric_limits<long double>::lowest();
-			for(int possible = 0; possible < KBBQ_MAXQ+1; ++possible){
-				int diff = std::abs(prior[i] - possible);
-				long double prior_prob = NormalPrior::get_normal_prior(diff);
-				long double p = recalibrateutils::q_to_p(possible);
-				long double loglike = log_binom_pmf((*this)[i][0] + 1, (*this)[i][1] + 2, p);
-				long double posterior = prior_prob + loglike;
-				if(posterior > best_posterior){
-					map_q = possible;
-					best_posterior = posterior;
+	long covariate_parse_key(size_t i, const char* s, size_t len){
+		CovariateParseKey f{i, s, len, -1};
+		ForEachCovariate<model_covariates>::apply(f);
+		return f.key;
+	}
+
+	size_t CycleCovariate::exact = 256;
+	size_t CycleCovariate::width = 0;
+	size_t CycleCovariate::half = 128;
+	int CycleCovariate::log2_exact = 8;
+
+	void CycleCovariate::set_binning(size_t exact, size_t width){
+		if(width == 0 && (exact < 2 || (exact & (exact - 1)) != 0)){
+			std::cerr << "Error: Log-spaced cycle bins need the number of exact cycles to be a power of 2 " <<
+				"greater than 1. Set a bin width to use other numbers." << std::endl;
+			throw std::invalid_argument("Invalid cycle binning.");
+		}
+		CycleCovariate::exact = exact;
+		CycleCovariate::width = width;
+		CycleCovariate::half = exact / 2;
+		CycleCovariate::log2_exact = 63 - __builtin_clzll(exact | 1);
+	}
+
+	int LongContextCovariate::size = 0;
+	uint64_t LongContextCovariate::mask = 0;
+
+	void LongContextCovariate::set_size(int k){
+		if(k < 0 || k == 2 || k > 8){
+			std::cerr << "Error: The long context must be 1 to 8 bases long, but not 2, " <<
+				"since the dinucleotide context is always in the model. Use 0 to turn it off." << std::endl;
+			throw std::invalid_argument("Invalid long context size " + std::to_string(k) + ".");
+		}
+		size = k;
+		mask = (1ULL << 2 * k) - 1;
+	}
+
+	const int16_t RecalibrationTable::untrained;
+
+	RecalibrationTable::RecalibrationTable(const dq_t& model, int minqual): nrg(model.meanq.size()), minqual(minqual){
+		nkeys.fill(0);
+		for(int rg = 0; rg < nrg; ++rg){
+			nq = std::max(nq, (int)model.qscoredq[rg].size());
+			for(size_t i = 0; i < ncovariates; ++i){
+				if(rg >= model.covariatedq[i].size()){continue;}
+				for(const std::vector<int>& keys : model.covariatedq[i][rg]){
+					nkeys[i] = std::max(nkeys[i], keys.size());
+				}
+			}
+		}
+		base.assign((size_t)nrg * nq, untrained);
+		for(int rg = 0; rg < nrg; ++rg){
+			for(int q = std::max(minqual, 0); q < model.qscoredq[rg].size(); ++q){
+				base[(size_t)rg * nq + q] = model.meanq[rg] + model.rgdq[rg] + model.qscoredq[rg][q];
+			}
+		}
+		for(size_t i = 0; i < ncovariates; ++i){
+			this->dqs[i].assign((size_t)nrg * nq * nkeys[i], 0);
+			const keydq_t& covariatedq = model.covariatedq[i];
+			for(int rg = 0; rg < std::min((int)covariatedq.size(), nrg); ++rg){
+				for(int q = 0; q < std::min((int)covariatedq[rg].size(), nq); ++q){
+					std::copy(covariatedq[rg][q].begin(), covariatedq[rg][q].end(),
+						this->dqs[i].begin() + ((size_t)rg * nq + q) * nkeys[i]);
 				}
 			}
-			dq[i] = map_q - prior[i];
 		}
-		return dq;
 	}
 
-	void CQCovariate::consume_read(const readutils::CReadData& read){
-		int rg = read.get_rg_int();
-		int q;
-		if(this->size() <= rg){this->resize(rg+1);}
-		for(size_t i = 0; i < read.skips.size(); ++i){
-			if(!read.skips[i]){
-				q = read.qual[i];
-				if(this->at(rg).size() <= q){this->at(rg).resize(q+1);}
-				(*this)[rg].increment(q, std::array<unsigned long long, 2>({read.errors[i], 1}));
+	int map_q(unsigned long long errors, unsigned long long total, int prior){
+		int map_q = 0; //maximum a posteriori q
+		long double best_posterior = std::numeric_limits<long double>::lowest();
+		for(int possible = 0; possible < KBBQ_MAXQ+1; possible++){
+			int diff = std::abs(prior - possible);
+			long double prior_prob = NormalPrior::get_normal_prior(diff);
+			long double p = recalibrateutils::q_to_p(possible);
+			long double loglike = log_binom_pmf(errors + 1, total + 2, p);
+			long double posterior = prior_prob + loglike;
+			if(posterior > best_posterior){
+				map_q = possible;
+				best_posterior = posterior;
 			}
 		}
+		return map_q;
 	}
 
-	qscoredq_t CQCovariate::delta_q(prior1_t prior){
-		qscoredq_t dq(this->size());
-		for(int i = 0; i < this->size(); ++i){ //i is rgs here
-			dq[i].resize((*this)[i].size());
-			for(int j = 0; j < (*this)[i].size(); ++j){ //j is q's here
-				int map_q = 0; //maximum a posteriori q
-				long double best_posterior = std::numeric_limits<long double>::lowest();
-				for(int possible = 0; possible < KBBQ_MAXQ+1; possible++){
-					int diff = std::abs(prior[i] - possible);
-					long double prior_prob = NormalPrior::get_normal_prior(diff);
-					long double p = recalibrateutils::q_to_p(possible);
-					long double loglike = log_binom_pmf((*this)[i][j][0] + 1, (*this)[i][j][1] + 2, p);
-					long double posterior = prior_prob + loglike;
-					if(posterior > best_posterior){
-						map_q = possible;
-						best_posterior = posterior;
-					}
+	//the tables are rounded from the same long double values map_q uses.
+	//priors too small for a double are set to -inf.
+	MAPFitter::MAPFitter(bool validate): normal_prior(2 * prior_offset + 1), validate(validate){
+		for(int q = 0; q < nq; ++q){
+			long double p = recalibrateutils::q_to_p(q);
+			logp[q] = std::log(p);
+			log1mp[q] = std::log1p(-p);
+		}
+		for(int i = 0; i <= 2 * prior_offset; ++i){
+			long double prior = NormalPrior::get_normal_prior(std::abs(i - prior_offset));
+			normal_prior[i] = prior < std::numeric_limits<double>::lowest() ?
+				-std::numeric_limits<double>::infinity() : (double)prior;
+		}
+	}
+
+	int MAPFitter::search_q(unsigned long long errors, unsigned long long total, int prior) const{
+		if(prior < nq - 1 - prior_offset || prior > prior_offset){
+			return map_q(errors, total, prior);
+		}
+		//the binomial coefficient is the same for every candidate, so it's left out.
+		const double* prior_row = &normal_prior[prior_offset - prior]; //prior_row[q] is the prior for q
+		double k = errors + 1;
+		double m = total + 1 - errors; //(total + 2) - k
+		//1 if the posterior rises from q to q+1, -1 if it falls, 0 if we can't tell.
+		//see scan_q for the tolerance.
+		auto rises = [&](int q) -> int {
+			double here = prior_row[q] + k * logp[q] + m * log1mp[q];
+			double next = prior_row[q+1] + k * logp[q+1] + m * log1mp[q+1];
+			double tolerance = 1e-12 * (-here - next + k + m);
+			if(!std::isfinite(here) || !std::isfinite(next) || std::abs(next - here) <= tolerance){
+				return 0;
+			}
+			return next > here ? 1 : -1;
+		};
+		//the answer is the first q in [1, nq-1] the posterior falls after, or nq-1 if it never does.
+		//q=0 is never the answer; its posterior is -inf since p=1.
+		//keep lo where it rises (0 counts) and hi where it falls (nq-1 counts) and close in.
+		int seed = std::round(-10 * std::log10((double)k / (k + m)));
+		seed = std::min(std::max(seed, 1), nq - 2);
+		int lo, hi;
+		int r = rises(seed);
+		if(r == 0){
+			return this->scan_q(errors, total, prior);
+		} else if(r > 0){
+			//gallop up
+			lo = seed;
+			hi = nq - 1;
+			for(int step = 1; lo + step < nq - 1; step *= 2){
+				r = rises(lo + step);
+				if(r == 0){
+					return this->scan_q(errors, total, prior);
+				} else if(r < 0){
+					hi = lo + step;
+					break;
+				}
+				lo += step;
+			}
+		} else {
+			//gallop down
+			hi = seed;
+			lo = 0;
+			for(int step = 1; hi - step > 0; step *= 2){
+				r = rises(hi - step);
+				if(r == 0){
+					return this->scan_q(errors, total, prior);
+				} else if(r > 0){
+					lo = hi - step;
+					break;
 				}
-				dq[i][j] = map_q - prior[i];
+				hi -= step;
 			}
 		}
-		return dq;
+		while(hi - lo > 1){
+			int mid = lo + (hi - lo) / 2;
+			r = rises(mid);
+			if(r == 0){
+				return this->scan_q(errors, total, prior);
+			}
+			(r > 0 ? lo : hi) = mid;
+		}
+		return hi;
 	}
 
-	void CCycleCovariate::consume_read(const readutils::CReadData& read){
-		int rg = read.get_rg_int();
-		int q;
-		int cycle;
-		if(this->size() <= rg){this->resize(rg+1);}
-		size_t readlen = read.skips.size();
-		for(size_t i = 0; i < readlen; ++i){
-			if(!read.skips[i]){
-				q = read.qual[i];
-				if((*this)[rg].size() <= q){(*this)[rg].resize(q+1);}
-				if((*this)[rg][q][read.second].size() <= i){(*this)[rg][q][read.second].resize(i+1);}
-				(*this)[rg][q][read.second].increment(i, read.errors[i], 1);
+	int MAPFitter::scan_q(unsigned long long errors, unsigned long long total, int prior) const{
+		if(prior < nq - 1 - prior_offset || prior > prior_offset){
+			return map_q(errors, total, prior);
+		}
+		const double* prior_row = &normal_prior[prior_offset - prior];
+		double k = errors + 1;
+		double m = total + 1 - errors;
+		std::array<double, nq> posterior;
+		for(int q = 0; q < nq; ++q){
+			posterior[q] = prior_row[q] + k * logp[q] + m * log1mp[q];
+		}
+		int best = 0;
+		double second = -std::numeric_limits<double>::infinity();
+		for(int q = 1; q < nq; ++q){
+			if(posterior[q] > posterior[best]){
+				second = posterior[best];
+				best = q;
+			} else if(posterior[q] > second){
+				second = posterior[q];
+			}
+		}
+		//every term is <= 0, so -posterior[best] is the size of the terms that were rounded;
+		//k + m bounds the size of the binomial coefficient map_q adds to each of them.
+		double tolerance = 1e-12 * (-2 * posterior[best] + k + m);
+		if(!std::isfinite(posterior[best]) || posterior[best] - second <= tolerance){
+			return map_q(errors, total, prior);
+		}
+		return best;
+	}
+
+	int MAPFitter::fit_one(unsigned long long errors, unsigned long long total, int prior) const{
+		int q = this->search_q(errors, total, prior);
+		if(validate){
+			int expected = this->scan_q(errors, total, prior);
+			if(q != expected){
+				std::cerr << "Error: MAP search found q " << q << " but the scan found " << expected <<
+					" for " << errors << " errors in " << total << " with prior " << prior << "." << std::endl;
+				throw std::logic_error("MAP search disagrees with the exhaustive scan.");
 			}
 		}
+		return q;
+	}
+
+	void MAPFitter::fit(std::vector<map_cell_t>& cells, int nthreads) const{
+		//priors outside the table are fit with map_q, which extends NormalPrior's table.
+		//extend it here so the threads only read it.
+		for(const map_cell_t& cell : cells){
+			if(cell.prior < nq - 1 - prior_offset || cell.prior > prior_offset){
+				NormalPrior::get_normal_prior(std::abs(cell.prior) + nq);
+			}
+		}
+		auto fit_range = [&](size_t begin, size_t end){
+			for(size_t i = begin; i < end; ++i){
+				cells[i].map_q = this->fit_one(cells[i].errors, cells[i].total, cells[i].prior);
+			}
+		};
+		if(nthreads <= 1 || cells.size() < 1024){
+			fit_range(0, cells.size());
+			return;
+		}
+		std::vector<std::thread> workers;
+		size_t chunk = (cells.size() + nthreads - 1) / nthreads;
+		std::vector<std::exception_ptr> errors((cells.size() + chunk - 1) / chunk);
+		for(size_t begin = 0; begin < cells.size(); begin += chunk){
+			workers.emplace_back([&, begin](){
+				try{
+					fit_range(begin, std::min(begin + chunk, cells.size()));
+				} catch(...) {
+					errors[begin / chunk] = std::current_exception();
+				}
+			});
+		}
+		for(std::thread& worker : workers){
+			worker.join();
+		}
+		for(std::exception_ptr& e : errors){
+			if(e){std::rethrow_exception(e);}
+		}
+	}
+
+	void CCovariate::increment(size_t idx, covariate_t value){
+		this->increment(idx,value[0],value[1]);
+	}
+
+	void CCovariate::increment(size_t idx, unsigned long long err, unsigned long long total){
+		this->at(idx)[0] += err;
+		this->at(idx)[1] += total;
+	}
+
+	void CCovariate::add(const CCovariate& other){
+		if(this->size() < other.size()){this->resize(other.size());}
+		for(size_t i = 0; i < other.size(); ++i){
+			(*this)[i][0] += other[i][0];
+			(*this)[i][1] += other[i][1];
+		}
 	}
 
-	cycledq_t CCycleCovariate::delta_q(prior2_t prior){
-		cycledq_t dq(this->size()); //rg -> q -> fwd(0)/rev(1) -> cycle -> values
+	rgdq_t CRGCovariate::delta_q(meanq_t prior, int nthreads, const MAPFitter& fitter){
+		std::vector<map_cell_t> cells;
+		for(int i = 0; i < this->size(); ++i){ //i is rgs here
+			cells.push_back({(*this)[i][0], (*this)[i][1], prior[i], 0});
+		}
+		fitter.fit(cells, nthreads);
+		rgdq_t dq(this->size());
+		for(int i = 0; i < this->size(); ++i){
+			dq[i] = cells[i].map_q - prior[i];
+		}
+		return dq;
+	}
+
+	qscoredq_t CQCovariate::delta_q(prior1_t prior, int nthreads, const MAPFitter& fitter){
+		std::vector<map_cell_t> cells;
 		for(int i = 0; i < this->size(); ++i){ //i is rgs here
-			dq[i].resize((*this)[i].size());
 			for(int j = 0; j < (*this)[i].size(); ++j){ //j is q's here
-				for(int k = 0; k < 2; ++k){ //fwd/rev
-					dq[i][j][k].resize((*this)[i][j][k].size());
-					for(int l = 0; l < (*this)[i][j][k].size(); ++l){ //cycle value
-						int map_q = 0; //maximum a posteriori q
-						long double best_posterior = std::numeric_limits<long double>::lowest();
-						for(int possible = 0; possible < KBBQ_MAXQ+1; possible++){
-							int diff = std::abs(prior[i][j] - possible);
-							long double prior_prob = NormalPrior::get_normal_prior(diff);
-							long double p = recalibrateutils::q_to_p(possible);
-							long double loglike = log_binom_pmf((*this)[i][j][k][l][0] + 1, (*this)[i][j][k][l][1] + 2, p);
-							long double posterior = prior_prob + loglike;
-							if(posterior > best_posterior){
-								map_q = possible;
-								best_posterior = posterior;
-							}
-						}
-						dq[i][j][k][l] = map_q - prior[i][j];
-					}
-				}
+				cells.push_back({(*this)[i][j][0], (*this)[i][j][1], prior[i], 0});
+			}
+		}
+		fitter.fit(cells, nthreads);
+		qscoredq_t dq(this->size());
+		std::vector<map_cell_t>::const_iterator cell = cells.begin();
+		for(int i = 0; i < this->size(); ++i){
+			dq[i].resize((*this)[i].size());
+			for(int j = 0; j < (*this)[i].size(); ++j){
+				dq[i][j] = (cell++)->map_q - prior[i];
 			}
 		}
 		return dq;
 	}
 
-	void CDinucCovariate::consume_read(const readutils::CReadData& read, int minscore){
-		int rg = read.get_rg_int();
-		if(this->size() <= rg){this->resize(rg+1);}
-		int q;
-		for(size_t i = 1; i < read.seq.length(); ++i){
-			q = read.qual[i];
-			if(!read.skips[i] && nt_is_not_n(read.seq[i]) &&
-				nt_is_not_n(read.seq[i-1]) && read.qual[i] >= minscore)
-			{
-				if((*this)[rg].size() <= q){(*this)[rg].resize(q+1);}
-				if((*this)[rg][q].size() < 16){(*this)[rg][q].resize(16);}
-				(*this)[rg][q].increment(dinuc_to_int(read.seq[i-1], read.seq[i]), read.errors[i], 1);
+	void CKeyedCovariate::add(const CKeyedCovariate& other){
+		if(this->size() < other.size()){this->resize(other.size());}
+		for(size_t rg = 0; rg < other.size(); ++rg){
+			if((*this)[rg].size() < other[rg].size()){(*this)[rg].resize(other[rg].size());}
+			for(size_t q = 0; q < other[rg].size(); ++q){
+				(*this)[rg][q].add(other[rg][q]);
 			}
 		}
-		// seq_nt16_table[256]: char -> 4 bit encoded (1/2/4/8)
-		// seq_nt16_str[]: 4 bit -> char
-		// seq_nt16_int[]: 4 bit -> 2 bits (0/1/2/3)
 	}
 
-	dinucdq_t CDinucCovariate::delta_q(prior2_t prior){
-		dinucdq_t dq(this->size()); //rg -> q -> fwd(0)/rev(1) -> cycle -> values
+	keydq_t CKeyedCovariate::delta_q(prior2_t prior, int nthreads, const MAPFitter& fitter){
+		std::vector<map_cell_t> cells;
 		for(int i = 0; i < this->size(); ++i){ //i is rgs here
-			dq[i].resize((*this)[i].size());
 			for(int j = 0; j < (*this)[i].size(); ++j){ //j is q's here
+				for(int k = 0; k < (*this)[i][j].size(); ++k){ //k is the key
+					cells.push_back({(*this)[i][j][k][0], (*this)[i][j][k][1], prior[i][j], 0});
+				}
+			}
+		}
+		fitter.fit(cells, nthreads);
+		keydq_t dq(this->size()); //rg -> q -> key -> values
+		std::vector<map_cell_t>::const_iterator cell = cells.begin();
+		for(int i = 0; i < this->size(); ++i){
+			dq[i].resize((*this)[i].size());
+			for(int j = 0; j < (*this)[i].size(); ++j){
 				dq[i][j].resize((*this)[i][j].size());
-				for(int k = 0; k < (*this)[i][j].size(); ++k){ //k is dinuc
-					int map_q = 0; //maximum a posteriori q
-					long double best_posterior = std::numeric_limits<long double>::lowest();
-					for(int possible = 0; possible < KBBQ_MAXQ+1; possible++){
-						int diff = std::abs(prior[i][j] - possible);
-						long double prior_prob = NormalPrior::get_normal_prior(diff);
-						long double p = recalibrateutils::q_to_p(possible);
-						long double loglike = log_binom_pmf((*this)[i][j][k][0] + 1, (*this)[i][j][k][1] + 2, p);
-						long double posterior = prior_prob + loglike;
-						if(posterior > best_posterior){
-							map_q = possible;
-							best_posterior = posterior;
-						}
-					}
-					dq[i][j][k] = map_q - prior[i][j];
+				for(int k = 0; k < (*this)[i][j].size(); ++k){
+					dq[i][j][k] = (cell++)->map_q - prior[i][j];
 				}
 			}
 		}
 		return dq;
 	}
 
+	struct CCovariateData::SetKeys{
+		CCovariateData& data;
+		template<size_t I, typename Covariate>
+		void apply(){data.nkeys[I] = Covariate::nkeys(data.ncycle);}
+	};
+
+	void CCovariateData::grow(size_t rgs, size_t qs, size_t cycles){
+		this->flush();
+		nrg = std::max(nrg, rgs);
+		nq = std::max(nq, qs);
+		ncycle = std::max(ncycle, cycles);
+		SetKeys set_keys{*this};
+		ForEachCovariate<model_covariates>::apply(set_keys);
+		//the counters are all 0 after a flush, so there's nothing to move.
+		qcounts.assign(nrg * nq * 2, 0);
+		for(size_t i = 0; i < ncovariates; ++i){
+			counts[i].assign(nrg * nq * nkeys[i] * 2, 0);
+		}
+	}
+
+	//count a base toward every covariate it has a key for.
+	struct CCovariateData::CountBase{
+		CCovariateData& data;
+		const BaseInfo& b;
+		size_t cell; //rg * nq + q
+		uint32_t e;
+		template<size_t I, typename Covariate>
+		inline void apply(){
+			long key = Covariate::key(b);
+			if(key >= 0){
+				uint32_t* counter = &data.counts[I][(cell * data.nkeys[I] + key) * 2];
+				counter[0] += e;
+				++counter[1];
+			}
+		}
+	};
+
 	void CCovariateData::consume_read(readutils::CReadData& read, int minscore){
 		//TODO: readd skips once the error correction code works properly
 		// for(int i = 0; i < read.seq.length(); ++i){
 		// 	read.skips[i] = (read.skips[i] || seq_nt16_int[seq_nt16_table[read.seq[i]]] >= 4 || read.qual[i] < minscore);
 		// }
-		rgcov.consume_read(read);
-		qcov.consume_read(read);
-		cycov.consume_read(read);
-		dicov.consume_read(read, minscore);
+		int rg = read.get_rg_int();
+		size_t len = read.skips.size();
+		size_t maxq = len > 0 ? *std::max_element(read.qual.begin(), read.qual.end()) : 0;
+		if(rg >= nrg || maxq >= nq || len > ncycle){
+			this->grow(rg + 1, std::max(maxq + 1, (size_t)KBBQ_MAXQ + 1), len);
+		} else if(pending + len > std::numeric_limits<uint32_t>::max()){
+			this->flush();
+		}
+		max_rg = std::max(max_rg, rg);
+		pending += len;
+		if(rgcov.size() <= rg){rgcov.resize(rg+1);}
+		uint32_t* q_rg = &qcounts[rg * nq * 2];
+		unsigned long long errors = 0;
+		unsigned long long total = 0;
+		BaseInfo b;
+		b.second = read.second;
+		for(size_t i = 0; i < len; ++i){
+			b.cycle = i;
+			b.push(read.seq.code(i));
+			if(!read.skips[i]){
+				b.q = read.qual[i];
+				b.lowq = b.q < minscore;
+				uint32_t e = read.errors[i];
+				errors += e;
+				++total;
+				uint32_t* qcell = q_rg + b.q * 2;
+				qcell[0] += e;
+				++qcell[1];
+				CountBase count{*this, b, rg * nq + b.q, e};
+				ForEachCovariate<model_covariates>::apply(count);
+			}
+		}
+		rgcov.increment(rg, errors, total);
 	}
 
-	dq_t CCovariateData::get_dqs(){
+	void CCovariateData::flush(){
+		if(max_rg < 0){return;}
+		//every covariate gets a slot for each rg seen, like rgcov.
+		if(qcov.size() <= max_rg){qcov.resize(max_rg + 1);}
+		for(CKeyedCovariate& covariate : covariates){
+			if(covariate.size() <= max_rg){covariate.resize(max_rg + 1);}
+		}
+		//the other dimensions only grow to fit what was seen.
+		for(size_t rg = 0; rg < nrg; ++rg){
+			for(size_t q = 0; q < nq; ++q){
+				const uint32_t* qcell = &qcounts[(rg * nq + q) * 2];
+				if(qcell[1] != 0){
+					if(qcov[rg].size() <= q){qcov[rg].resize(q+1);}
+					qcov[rg].increment(q, qcell[0], qcell[1]);
+				}
+				for(size_t i = 0; i < ncovariates; ++i){
+					const uint32_t* keys = &counts[i][(rg * nq + q) * nkeys[i] * 2];
+					size_t seen = nkeys[i];
+					while(seen > 0 && keys[(seen - 1) * 2 + 1] == 0){--seen;}
+					if(seen == 0){continue;}
+					if(covariates[i][rg].size() <= q){covariates[i][rg].resize(q+1);}
+					CCovariate& cov = covariates[i][rg][q];
+					if(cov.size() < seen){cov.resize(seen);}
+					for(size_t key = 0; key < seen; ++key){
+						cov.increment(key, keys[key * 2], keys[key * 2 + 1]);
+					}
+				}
+			}
+		}
+		std::fill(qcounts.begin(), qcounts.end(), 0);
+		for(std::vector<uint32_t>& keys : counts){
+			std::fill(keys.begin(), keys.end(), 0);
+		}
+		max_rg = -1;
+		pending = 0;
+	}
+
+	void CCovariateData::merge(CCovariateData& other){
+		this->flush();
+		other.flush();
+		rgcov.add(other.rgcov);
+		if(qcov.size() < other.qcov.size()){qcov.resize(other.qcov.size());}
+		for(size_t rg = 0; rg < other.qcov.size(); ++rg){
+			qcov[rg].add(other.qcov[rg]);
+		}
+		for(size_t i = 0; i < ncovariates; ++i){
+			covariates[i].add(other.covariates[i]);
+		}
+	}
+
+	dq_t CCovariateData::get_dqs(int nthreads, bool validate){
+		this->flush();
+		MAPFitter fitter(validate);
 		dq_t dq;
 		std::vector<long double> expected_errors(this->qcov.size(),0);
 		meanq_t meanq(this->qcov.size(),0);
@@ -212,20 +529,21 @@ namespace covariateutils{
 			meanq[rg] = recalibrateutils::p_to_q(expected_errors[rg] / this->rgcov[rg][1]);
 		}
 		dq.meanq = meanq;
-		dq.rgdq = this->rgcov.delta_q(meanq);
+		dq.rgdq = this->rgcov.delta_q(meanq, nthreads, fitter);
 		prior1_t rgprior(this->qcov.size());
 		for(int rg = 0; rg < this->qcov.size(); ++rg){
 			rgprior[rg] = meanq[rg] + dq.rgdq[rg];
 		}
-		dq.qscoredq = this->qcov.delta_q(rgprior);
+		dq.qscoredq = this->qcov.delta_q(rgprior, nthreads, fitter);
 		prior2_t qprior(this->qcov.size());
 		for(int rg = 0; rg < this->qcov.size(); ++rg){
 			for(int q = 0; q < this->qcov[rg].size(); ++q){
 				qprior[rg].push_back(rgprior[rg] + dq.qscoredq[rg][q]);
 			}
 		}
-		dq.cycledq = this->cycov.delta_q(qprior);
-		dq.dinucdq = this->dicov.delta_q(qprior);
+		for(size_t i = 0; i < ncovariates; ++i){
+			dq.covariatedq[i] = this->covariates[i].delta_q(qprior, nthreads, fitter);
+		}
 		return dq;
 	}
 
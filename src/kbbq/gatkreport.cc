@@ -0,0 +1,484 @@
+#include "gatkreport.hh"
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace gatkreport{
+
+	column_type format_type(const std::string& format){
+		char c = format.empty() ? 's' : format.back();
+		if(c == 'd'){
+			return INT;
+		} else if(c == 'f' || c == 'e' || c == 'g'){
+			return FLOAT;
+		} else {
+			return STRING;
+		}
+	}
+
+	GATKTable::GATKTable(const std::string& title, const std::string& description,
+		const std::vector<std::string>& headers, const std::vector<std::string>& formats):
+		title(title), description(description), headers(headers), formats(formats), types(), cells()
+	{
+		if(headers.size() != formats.size() || headers.empty()){
+			throw std::invalid_argument("Error: Table " + title + " needs a format for each of its columns.");
+		}
+		for(const std::string& format : formats){
+			types.push_back(format_type(format));
+		}
+	}
+
+	GATKTable& GATKTable::add(const std::string& value){
+		cells.push_back(value);
+		return *this;
+	}
+
+	GATKTable& GATKTable::add(long long value){
+		if(types[cells.size() % headers.size()] == FLOAT){
+			return this->add((double)value);
+		}
+		cells.push_back(std::to_string(value));
+		return *this;
+	}
+
+	GATKTable& GATKTable::add(double value){
+		size_t col = cells.size() % headers.size();
+		if(types[col] == INT){
+			return this->add((long long)value);
+		} else if(types[col] == STRING){
+			return this->add(std::to_string(value));
+		}
+		char buf[64];
+		std::snprintf(buf, sizeof(buf), formats[col].c_str(), value);
+		cells.emplace_back(buf);
+		return *this;
+	}
+
+	void GATKTable::write(std::ostream& os) const{
+		os << "#:GATKTable:" << this->ncols() << ":" << this->nrows() << ":";
+		for(const std::string& format : formats){
+			os << format << ":";
+		}
+		os << ";\n";
+		os << "#:GATKTable:" << title << ":" << description << "\n";
+		std::vector<size_t> widths(headers.size());
+		for(size_t i = 0; i < headers.size(); ++i){
+			widths[i] = headers[i].length();
+		}
+		for(size_t i = 0; i < cells.size(); ++i){
+			widths[i % headers.size()] = std::max(widths[i % headers.size()], cells[i].length());
+		}
+		for(size_t i = 0; i < headers.size(); ++i){
+			os << (i > 0 ? "  " : "") << (types[i] == STRING ? std::left : std::right) <<
+				std::setw(widths[i]) << headers[i];
+		}
+		os << "\n";
+		for(size_t i = 0; i + headers.size() <= cells.size(); i += headers.size()){
+			for(size_t j = 0; j < headers.size(); ++j){
+				os << (j > 0 ? "  " : "") << (types[j] == STRING ? std::left : std::right) <<
+					std::setw(widths[j]) << cells[i + j];
+			}
+			os << "\n";
+		}
+		os << "\n" << std::right;
+	}
+
+	void GATKReport::write(std::ostream& os) const{
+		os << "#:GATKReport.v1.1:" << tables.size() << "\n";
+		for(const GATKTable& table : tables){
+			table.write(os);
+		}
+	}
+
+	ReportReader::ReportReader(std::istream& in): in(in){
+		static const std::string prefix = "#:GATKReport.v1.";
+		if(!this->getline() || line.compare(0, prefix.length(), prefix) != 0){
+			this->fail("Input is not a version 1 GATK report.");
+		}
+		size_t colon = line.rfind(':');
+		char* end = NULL;
+		if(colon != std::string::npos){
+			ntables = std::strtoull(line.c_str() + colon + 1, &end, 10);
+		}
+		if(end == NULL || end == line.c_str() + colon + 1 || *end != '\0'){
+			this->fail("Unable to read the number of tables in the report.");
+		}
+	}
+
+	bool ReportReader::getline(){
+		if(!std::getline(in, line)){
+			return false;
+		}
+		++lineno;
+		if(!line.empty() && line.back() == '\r'){
+			line.pop_back();
+		}
+		return true;
+	}
+
+	void ReportReader::split(){
+		fields.clear();
+		const char* s = line.c_str();
+		size_t i = 0;
+		while(true){
+			while(s[i] == ' ' || s[i] == '\t'){++i;}
+			if(s[i] == '\0'){break;}
+			size_t start = i;
+			while(s[i] != ' ' && s[i] != '\t' && s[i] != '\0'){++i;}
+			fields.emplace_back(start, i - start);
+		}
+	}
+
+	void ReportReader::fail(const std::string& msg) const{
+		std::cerr << "Error: " << msg << " (line " << lineno << " of the GATK report)" << std::endl;
+		throw std::invalid_argument(msg);
+	}
+
+	bool ReportReader::next_table(){
+		for(; rows_left > 0; --rows_left){
+			if(!this->getline()){
+				this->fail("The report ends in the middle of table " + title + ".");
+			}
+		}
+		//tables are separated by blank lines
+		do{
+			if(!this->getline()){
+				if(tables_read < ntables){
+					this->fail("The report declares " + std::to_string(ntables) + " tables but has " +
+						std::to_string(tables_read) + ". Ensure it isn't truncated.");
+				}
+				return false;
+			}
+		} while(line.find_first_not_of(" \t") == std::string::npos);
+		static const std::string prefix = "#:GATKTable:";
+		if(line.compare(0, prefix.length(), prefix) != 0){
+			this->fail("Expected a table header.");
+		}
+		//#:GATKTable:ncols:nrows:format:...:;
+		const char* s = line.c_str() + prefix.length();
+		char* end;
+		size_t ncols = std::strtoull(s, &end, 10);
+		if(*end != ':'){this->fail("Unable to read the number of columns.");}
+		size_t nrows = std::strtoull(end + 1, &end, 10);
+		if(*end != ':'){this->fail("Unable to read the number of rows.");}
+		types.clear();
+		for(s = end + 1; *s != ';' && *s != '\0';){
+			const char* next = std::strchr(s, ':');
+			if(next == NULL){next = s + std::strlen(s);}
+			types.push_back(format_type(std::string(s, next)));
+			s = *next == ':' ? next + 1 : next;
+		}
+		if(types.size() != ncols){
+			this->fail("The table declares " + std::to_string(ncols) + " columns but has " +
+				std::to_string(types.size()) + " formats.");
+		}
+		//#:GATKTable:title:description
+		if(!this->getline() || line.compare(0, prefix.length(), prefix) != 0){
+			this->fail("Expected a table title.");
+		}
+		title = line.substr(prefix.length(), line.find(':', prefix.length()) - prefix.length());
+		if(!this->getline()){
+			this->fail("The report ends before the column headers of table " + title + ".");
+		}
+		this->split();
+		if(fields.size() != ncols){
+			this->fail("Table " + title + " declares " + std::to_string(ncols) + " columns but has " +
+				std::to_string(fields.size()) + " headers.");
+		}
+		headers.clear();
+		for(size_t i = 0; i < fields.size(); ++i){
+			headers.push_back(this->str(i));
+		}
+		rows_left = nrows;
+		++tables_read;
+		return true;
+	}
+
+	bool ReportReader::next_row(){
+		if(rows_left == 0){
+			return false;
+		}
+		if(!this->getline()){
+			this->fail("The report ends in the middle of table " + title + ".");
+		}
+		--rows_left;
+		this->split();
+		if(fields.size() != headers.size()){
+			this->fail("Expected " + std::to_string(headers.size()) + " values in a row of table " +
+				title + " but found " + std::to_string(fields.size()) + ".");
+		}
+		return true;
+	}
+
+	int ReportReader::column(const std::string& h) const{
+		for(size_t i = 0; i < headers.size(); ++i){
+			if(headers[i] == h){
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	long long ReportReader::integer(size_t i) const{
+		char* end;
+		long long value = std::strtoll(this->field(i), &end, 10);
+		if(end != this->field(i) + this->field_length(i)){
+			this->fail("Unable to read " + this->str(i) + " as an integer.");
+		}
+		return value;
+	}
+
+	double ReportReader::number(size_t i) const{
+		char* end;
+		double value = std::strtod(this->field(i), &end);
+		if(end != this->field(i) + this->field_length(i)){
+			this->fail("Unable to read " + this->str(i) + " as a number.");
+		}
+		return value;
+	}
+
+	namespace{
+		//reports can't hold an empty read group name, so the read group of fastq reads without
+		//an RG field gets the name GATK uses for missing values.
+		const std::string empty_rg = "null";
+
+		inline std::string report_rg(const readutils::ReadGroups& rgs, int rg){
+			std::string pu = rgs.pu(rg);
+			return pu == "" ? empty_rg : pu;
+		}
+	}
+
+	GATKReport recalibration_report(const covariateutils::CCovariateData& data,
+		const covariateutils::dq_t& dqs, const readutils::ReadGroups& rgs)
+	{
+		using namespace covariateutils;
+		GATKReport report;
+		//covariate names as GATK lists them, eg. ContextCovariate. rows of RecalTable2 are
+		//matched to covariates by name, so two covariates can't share one.
+		//LongContext isn't a GATK covariate; only kbbq can read reports that use it.
+		std::vector<std::string> names;
+		int context_size = 2;
+		for(size_t i = 0; i < ncovariates; ++i){
+			names.push_back(covariate_name(i) + "Covariate");
+			if(covariate_name(i) == "Context"){
+				context_size = covariate_key_str(i, 0).length();
+			}
+		}
+		std::sort(names.begin(), names.end());
+		if(std::adjacent_find(names.begin(), names.end()) != names.end()){
+			std::cerr << "Error: Two covariates in the model are named " << *std::adjacent_find(names.begin(), names.end()) <<
+				". Unable to write a recalibration report." << std::endl;
+			throw std::invalid_argument("Covariate names in a recalibration report must be unique.");
+		}
+		std::string covariates = "ReadGroupCovariate,QualityScoreCovariate";
+		for(const std::string& name : names){
+			covariates += "," + name;
+		}
+
+		GATKTable arguments("Arguments", "Recalibration argument collection values used in this run",
+			{"Argument", "Value"}, {"%s", "%s"});
+		arguments.add("binary_tag_name").add("null");
+		arguments.add("covariate").add(covariates);
+		arguments.add("default_platform").add("null");
+		arguments.add("deletions_default_quality").add(45);
+		arguments.add("force_platform").add("null");
+		arguments.add("indels_context_size").add(3);
+		arguments.add("insertions_default_quality").add(45);
+		arguments.add("low_quality_tail").add(2);
+		arguments.add("maximum_cycle_value").add(500);
+		arguments.add("mismatches_context_size").add(context_size);
+		arguments.add("mismatches_default_quality").add(-1);
+		arguments.add("no_standard_covs").add("false");
+		arguments.add("plot_pdf_file").add("null");
+		arguments.add("quantizing_levels").add(16);
+		arguments.add("recalibration_report").add("null");
+		arguments.add("run_without_dbsnp").add("false");
+		arguments.add("solid_nocall_strategy").add("THROW_EXCEPTION");
+		arguments.add("solid_recal_mode").add("SET_Q_ZERO");
+		report.add_table(arguments);
+
+		//kbbq doesn't quantize, so every quality maps to itself.
+		GATKTable quantized("Quantized", "Quality quantization map",
+			{"QualityScore", "Count", "QuantizedScore"}, {"%d", "%d", "%d"});
+		for(int q = 0; q <= KBBQ_MAXQ; ++q){
+			unsigned long long count = 0;
+			for(const CCovariate& qs : data.qcov){
+				count += q < qs.size() ? qs[q][1] : 0;
+			}
+			quantized.add(q).add(count).add(q);
+		}
+		report.add_table(quantized);
+
+		GATKTable rgtable("RecalTable0", "",
+			{"ReadGroup", "EventType", "EmpiricalQuality", "EstimatedQReported", "Observations", "Errors"},
+			{"%s", "%s", "%.4f", "%.4f", "%d", "%.2f"});
+		for(size_t rg = 0; rg < data.rgcov.size(); ++rg){
+			if(data.rgcov[rg][1] == 0 || rg >= dqs.meanq.size()){continue;}
+			long double expected_errors = 0;
+			for(size_t q = 0; rg < data.qcov.size() && q < data.qcov[rg].size(); ++q){
+				expected_errors += recalibrateutils::q_to_p(q) * data.qcov[rg][q][1];
+			}
+			rgtable.add(report_rg(rgs, rg)).add("M").add((double)(dqs.meanq[rg] + dqs.rgdq[rg])).
+				add((double)(-10.0l * std::log10(expected_errors / data.rgcov[rg][1]))).
+				add(data.rgcov[rg][1]).add((double)data.rgcov[rg][0]);
+		}
+		report.add_table(rgtable);
+
+		//like GATK, the empirical quality of the finer tables is fit with the reported
+		//quality as its prior; it's only informative, since readers refit from the counts.
+		MAPFitter fitter;
+		std::vector<map_cell_t> cells;
+		for(size_t rg = 0; rg < data.qcov.size(); ++rg){
+			for(size_t q = 0; q < data.qcov[rg].size(); ++q){
+				if(data.qcov[rg][q][1] == 0){continue;}
+				cells.push_back({data.qcov[rg][q][0], data.qcov[rg][q][1], (int)q, 0});
+			}
+		}
+		fitter.fit(cells);
+		GATKTable qtable("RecalTable1", "",
+			{"ReadGroup", "QualityScore", "EventType", "EmpiricalQuality", "Observations", "Errors"},
+			{"%s", "%d", "%s", "%.4f", "%d", "%.2f"});
+		std::vector<map_cell_t>::const_iterator cell = cells.begin();
+		for(size_t rg = 0; rg < data.qcov.size(); ++rg){
+			for(size_t q = 0; q < data.qcov[rg].size(); ++q){
+				if(data.qcov[rg][q][1] == 0){continue;}
+				qtable.add(report_rg(rgs, rg)).add(q).add("M").add((double)(cell++)->map_q).
+					add(data.qcov[rg][q][1]).add((double)data.qcov[rg][q][0]);
+			}
+		}
+		report.add_table(qtable);
+
+		cells.clear();
+		for(size_t i = 0; i < ncovariates; ++i){
+			const CKeyedCovariate& covariate = data.covariates[i];
+			for(size_t rg = 0; rg < covariate.size(); ++rg){
+				for(size_t q = 0; q < covariate[rg].size(); ++q){
+					for(const covariate_t& c : covariate[rg][q]){
+						if(c[1] == 0){continue;}
+						cells.push_back({c[0], c[1], (int)q, 0});
+					}
+				}
+			}
+		}
+		fitter.fit(cells);
+		GATKTable covtable("RecalTable2", "",
+			{"ReadGroup", "QualityScore", "CovariateValue", "CovariateName", "EventType",
+				"EmpiricalQuality", "Observations", "Errors"},
+			{"%s", "%d", "%s", "%s", "%s", "%.4f", "%d", "%.2f"});
+		cell = cells.begin();
+		for(size_t i = 0; i < ncovariates; ++i){
+			const CKeyedCovariate& covariate = data.covariates[i];
+			std::string name = covariate_name(i);
+			for(size_t rg = 0; rg < covariate.size(); ++rg){
+				std::string rgname = report_rg(rgs, rg);
+				for(size_t q = 0; q < covariate[rg].size(); ++q){
+					for(size_t key = 0; key < covariate[rg][q].size(); ++key){
+						const covariate_t& c = covariate[rg][q][key];
+						if(c[1] == 0){continue;}
+						covtable.add(rgname).add(q).add(covariate_key_str(i, key)).add(name).add("M").
+							add((double)(cell++)->map_q).add(c[1]).add((double)c[0]);
+					}
+				}
+			}
+		}
+		report.add_table(covtable);
+		return report;
+	}
+
+	void read_recalibration_report(std::istream& in, readutils::ReadGroups& rgs,
+		covariateutils::CCovariateData& data)
+	{
+		using namespace covariateutils;
+		data.flush();
+		std::vector<std::string> names;
+		for(size_t i = 0; i < ncovariates; ++i){
+			names.push_back(covariate_name(i));
+		}
+		ReportReader report(in);
+		//rows of a read group come together, so the last one found is kept.
+		std::string last_rg("");
+		int last_rgid = -1;
+		auto rg_id = [&](size_t col) -> int {
+			if(last_rgid < 0 || !report.equals(col, last_rg.c_str())){
+				last_rg = report.str(col);
+				last_rgid = rgs.find_pu(last_rg);
+				if(last_rgid < 0){
+					last_rgid = rgs.id(last_rg == empty_rg ? "" : last_rg);
+				}
+			}
+			return last_rgid;
+		};
+		auto add = [](CCovariate& cov, size_t idx, unsigned long long errors, unsigned long long total){
+			if(cov.size() <= idx){cov.resize(idx + 1);}
+			cov.increment(idx, errors, total);
+		};
+		while(report.next_table()){
+			const std::string& title = report.table_title();
+			int table = title == "RecalTable0" ? 0 : title == "RecalTable1" ? 1 : title == "RecalTable2" ? 2 : -1;
+			if(table < 0){continue;}
+			int rgcol = report.column("ReadGroup");
+			int qcol = report.column("QualityScore");
+			int valuecol = report.column("CovariateValue");
+			int namecol = report.column("CovariateName");
+			int eventcol = report.column("EventType");
+			int obscol = report.column("Observations");
+			int errcol = report.column("Errors");
+			if(rgcol < 0 || eventcol < 0 || obscol < 0 || errcol < 0 || (table >= 1 && qcol < 0) ||
+				(table == 2 && (valuecol < 0 || namecol < 0)))
+			{
+				std::cerr << "Error: Table " << title << " of the GATK report is missing a column." << std::endl;
+				throw std::invalid_argument("Table " + title + " of the GATK report is missing a column.");
+			}
+			while(report.next_row()){
+				if(!report.equals(eventcol, "M")){continue;}
+				int rg = rg_id(rgcol);
+				long long total = report.integer(obscol);
+				double errors = report.number(errcol);
+				if(total < 0 || !(errors >= 0)){
+					std::cerr << "Error: Negative count in table " << title << " of the GATK report." << std::endl;
+					throw std::invalid_argument("Negative count in table " + title + " of the GATK report.");
+				}
+				//errors can be fractional when GATK weights them by BAQ.
+				unsigned long long nerrors = (unsigned long long)(errors + .5);
+				if(table == 0){
+					add(data.rgcov, rg, nerrors, total);
+					continue;
+				}
+				long long q = report.integer(qcol);
+				if(q < 0 || q > KBBQ_MAXQ){continue;}
+				if(table == 1){
+					if(data.qcov.size() <= rg){data.qcov.resize(rg + 1);}
+					add(data.qcov[rg], q, nerrors, total);
+					continue;
+				}
+				for(size_t i = 0; i < ncovariates; ++i){
+					if(!report.equals(namecol, names[i].c_str())){continue;}
+					long key = covariate_parse_key(i, report.field(valuecol), report.field_length(valuecol));
+					if(key < 0){continue;}
+					CKeyedCovariate& covariate = data.covariates[i];
+					if(covariate.size() <= rg){covariate.resize(rg + 1);}
+					if(covariate[rg].size() <= q){covariate[rg].resize(q + 1);}
+					add(covariate[rg][q], key, nerrors, total);
+				}
+			}
+		}
+		//get_dqs expects every read group in every covariate, and a prior for each quality.
+		size_t nrg = std::max(data.rgcov.size(), data.qcov.size());
+		for(const CKeyedCovariate& covariate : data.covariates){
+			nrg = std::max(nrg, covariate.size());
+		}
+		data.rgcov.resize(nrg);
+		data.qcov.resize(nrg);
+		for(CKeyedCovariate& covariate : data.covariates){
+			covariate.resize(nrg);
+			for(size_t rg = 0; rg < nrg; ++rg){
+				if(data.qcov[rg].size() < covariate[rg].size()){
+					data.qcov[rg].resize(covariate[rg].size());
+				}
+			}
+		}
+	}
+
+}
@@ -1,37 +1,109 @@
 #include "htsiter.hh"
+#include <cmath>
+#include <cstring>
 
 namespace htsiter{
 
+size_t HTSFile::get_batch(std::vector<readutils::CReadData>& reads){
+	size_t n = 0;
+	while(n < reads.size() && this->next() >= 0){
+		this->get(reads[n++]);
+	}
+	return n;
+}
+
+int HTSFile::rg_int(const char* rg, size_t len){
+	if(last_rgid < 0 || last_rg.compare(0, std::string::npos, rg, len) != 0){
+		last_rg.assign(rg, len);
+		last_rgid = this->rgs.id(last_rg);
+	}
+	return last_rgid;
+}
+
 int BamFile::next(){return sam_read1(sf, h, r);}//return sam_itr_next(sf, itr, r);
 	// return next read as a string. if there are no more, return the empty string.
 std::string BamFile::next_str(){return this->next() >= 0 ? readutils::bam_seq_str(r) : "";}
 //
-readutils::CReadData BamFile::get(){return readutils::CReadData(this->r, use_oq);}
+readutils::CReadData BamFile::get(){
+	readutils::CReadData read;
+	this->get(read);
+	return read;
+}
+
+void BamFile::get(readutils::CReadData& read){
+	readutils::BamReadView view(this->r, use_oq);
+	const char* rg = view.rg();
+	read.fill(view, this->rg_int(rg, std::strlen(rg)));
+}
+
+void BamFile::get_qual(std::vector<uint8_t>& qual){
+	readutils::BamReadView view(this->r, use_oq);
+	qual.resize(view.length());
+	for(size_t i = 0; i < qual.size(); ++i){
+		qual[i] = view.qual(i);
+	}
+}
 //
-void BamFile::recalibrate(const std::vector<uint8_t>& qual){
-	uint8_t* q = bam_get_qual(this->r);
-	if(set_oq){
-		std::string qstr;
-		std::transform(q, q + this->r->core.l_qseq, std::back_inserter(qstr),
-			[](uint8_t c) -> char {return c + 33;}); //qual value to actual str
-		//returns 0 on success, -1 on fail. We should consider throwing if it fails.
-		if(bam_aux_update_str(this->r, "OQ", qstr.length()+1, qstr.c_str()) != 0){
-			if(errno == ENOMEM){
-				std::cerr << "Insufficient memory to expand bam record." << std::endl;
-			} else if(errno == EINVAL){
-				std::cerr << "Tag data is corrupt. Repair the tags and try again." << std::endl;
-			}
-			throw std::invalid_argument("Unable to update OQ tag.");
+void BamFile::get_kmers(std::vector<bloom::Kmer>& kmers, int k){
+	kmers.clear();
+	for(readutils::BamKmerIterator it(this->r, k); it.next();){
+		if(it.pos() >= k-1){
+			kmers.push_back(*it);
+		}
+	}
+}
+
+void BamFile::append_kmers(std::vector<uint64_t>& kmers, int k, const std::vector<size_t>& idx){
+	readutils::BamKmerIterator it(this->r, k);
+	for(size_t i : idx){
+		while(it.next() && it.pos() < i+k-1){}
+		if(it->valid()){
+			kmers.push_back(it->get());
+		}
+	}
+}
+//
+void BamFile::set_oq_tag(){
+	const uint8_t* q = bam_get_qual(this->r);
+	size_t len = this->r->core.l_qseq;
+	oqbuf.resize(len + 1);
+	for(size_t i = 0; i < len; ++i){
+		oqbuf[i] = q[i] + 33; //qual value to actual str
+	}
+	oqbuf[len] = '\0';
+	//returns 0 on success, -1 on fail. We should consider throwing if it fails.
+	if(bam_aux_update_str(this->r, "OQ", len + 1, oqbuf.data()) != 0){
+		if(errno == ENOMEM){
+			std::cerr << "Insufficient memory to expand bam record." << std::endl;
+		} else if(errno == EINVAL){
+			std::cerr << "Tag data is corrupt. Repair the tags and try again." << std::endl;
 		}
+		throw std::invalid_argument("Unable to update OQ tag.");
 	}
+}
+
+void BamFile::recalibrate(const covariateutils::RecalibrationTable& table){
+	size_t len;
+	{
+		//the view may read from the OQ tag, so it has to be done before the tag is set.
+		readutils::BamReadView view(this->r, use_oq);
+		const char* rg = view.rg();
+		len = view.length();
+		qbuf.resize(len);
+		for(size_t i = 0; i < len; ++i){
+			qbuf[i] = view.qual(i);
+		}
+		table.recalibrate(this->rg_int(rg, std::strlen(rg)), view.second(), view, qbuf.data(), len, qbuf.data());
+	}
+	if(set_oq){
+		this->set_oq_tag();
+	}
+	uint8_t* q = bam_get_qual(this->r); //setting the tag may have moved the record's data
 	if(bam_is_rev(this->r)){
-		std::reverse_copy(qual.begin(), qual.end(), q);
+		std::reverse_copy(qbuf.begin(), qbuf.end(), q);
 	} else {
-		std::copy(qual.begin(), qual.end(), q);
+		std::copy(qbuf.begin(), qbuf.end(), q);
 	}
-	// for(int i = 0; i < this->r->core.l_qseq; ++i){
-	// 	q[i] = (char)qual[i];
-	// }
 }
 // TODO:: add a PG tag to the header
 int BamFile::open_out(std::string filename){
@@ -43,6 +115,8 @@ int BamFile::open_out(std::string filename){
 }
 //
 int BamFile::write(){return sam_write1(this->of, this->h, this->r);}
+//
+void BamFile::load_header_rgs(){this->rgs.load_from_header(this->h);}
 
 // FastqFile class
 
@@ -55,12 +129,59 @@ std::string FastqFile::next_str(){
 }
 
 readutils::CReadData FastqFile::get(){
-	return readutils::CReadData(this->r);
+	readutils::CReadData read;
+	this->get(read);
+	return read;
+}
+
+void FastqFile::get(readutils::CReadData& read){
+	readutils::FastqHeader header(this->r);
+	read.fill(this->r, header, this->rg_int(header.rg, header.rg_len));
+}
+
+void FastqFile::get_qual(std::vector<uint8_t>& qual){
+	qual.resize(this->r->qual.l);
+	for(size_t i = 0; i < qual.size(); ++i){
+		qual[i] = this->r->qual.s[i] - 33;
+	}
 }
 
-void FastqFile::recalibrate(const std::vector<uint8_t>& qual){
-	for(int i = 0; i < this->r->qual.l; ++i){
-		this->r->qual.s[i] = (char)(qual[i]+33);
+void FastqFile::get_kmers(std::vector<bloom::Kmer>& kmers, int k){
+	bloom::Kmer kmer(k);
+	kmers.clear();
+	for(size_t i = 0; i < this->r->seq.l; ++i){
+		kmer.push_back(this->r->seq.s[i]);
+		if(i >= k-1){
+			kmers.push_back(kmer);
+		}
+	}
+}
+
+void FastqFile::append_kmers(std::vector<uint64_t>& kmers, int k, const std::vector<size_t>& idx){
+	bloom::Kmer kmer(k);
+	size_t j = 0;
+	for(size_t i : idx){
+		for(; j < i+k && j < this->r->seq.l; ++j){
+			kmer.push_back(this->r->seq.s[j]);
+		}
+		if(kmer.valid()){
+			kmers.push_back(kmer.get());
+		}
+	}
+}
+
+void FastqFile::recalibrate(const covariateutils::RecalibrationTable& table){
+	readutils::FastqHeader header(this->r);
+	//the qualities are converted to values and back in place.
+	uint8_t* q = (uint8_t*)this->r->qual.s;
+	size_t len = this->r->seq.l;
+	for(size_t i = 0; i < len; ++i){
+		q[i] -= 33;
+	}
+	table.recalibrate(this->rg_int(header.rg, header.rg_len), header.mate == 2,
+		bloom::SeqView(this->r->seq.s, len), q, len, q);
+	for(size_t i = 0; i < len; ++i){
+		q[i] += 33;
 	}
 }
 
@@ -86,53 +207,56 @@ int FastqFile::write(){
 }
 
 // KmerSubsampler
-bloom::Kmer KmerSubsampler::next_kmer(){
-	if(cur_kmer < kmers.size()){
-		return kmers[cur_kmer++]; //return the current kmer and advance
-	} else {
-		readseq = file->next_str();
-		kmer.reset();
-		if(readseq.empty()){
-			this->not_eof = false;
-			return kmer; //no more sequences
-		} else {
-			kmers.clear();
-			for(size_t i = 0; i < readseq.length(); ++i){
-				kmer.push_back(readseq[i]);
-				if(i >= k-1){
-					kmers.push_back(kmer);
-				}
-			}
-			cur_kmer = 0; //reset current kmer
-			total_kmers += kmers.size();
-			return this->next_kmer(); //try again
-		}
+void KmerSubsampler::seed_read(uint64_t ordinal){
+	uint64_t s = this->seed ^ minion::detail::splitmix64(&ordinal);
+	minion::Random::state_type state;
+	for(uint64_t& x : state){
+		x = minion::detail::splitmix64(&s);
 	}
+	rng.InitState(state);
 }
 
-bloom::Kmer KmerSubsampler::next(){
-	bloom::Kmer kmer = this->next_kmer();
-	if(this->not_eof){
+size_t KmerSubsampler::draw_skip(){
 #ifdef KBBQ_USE_RAND_SAMPLER
-		double p = std::rand() / (double)RAND_MAX;
-		if(p < this->d.p()){
+	//consume one draw per kmer so the sequence matches a per-kmer bernoulli
+	size_t n = 0;
+	while(std::rand() / (double)RAND_MAX >= this->alpha){
+		++n;
+	}
+	return n;
 #else
-		if(d(rng)){ //sampled
+	if(this->alpha >= 1){
+		return 0;
+	}
+	//inverse cdf of the geometric distribution; f52 is in (0,1) so the log is finite.
+	return std::floor(std::log(rng.f52()) / std::log1p(-this->alpha));
 #endif
-			return kmer;
+}
+
+size_t KmerSubsampler::next_batch(std::vector<uint64_t>& kmers, size_t batch_size){
+	kmers.clear();
+	while(kmers.size() < batch_size){
+		if(file->next() < 0){
+			this->not_eof = false;
+			break;
 		}
-		else{ //try again
-			return this->next();
+		size_t len = file->seq_len();
+		size_t nkmers = len >= k ? len - k + 1 : 0;
+		sampled_idx.clear();
+#ifndef KBBQ_USE_RAND_SAMPLER
+		//sampling is memoryless, so starting fresh at each read doesn't change the distribution.
+		seed_read(read_ordinal);
+		skip = draw_skip();
+#endif
+		++read_ordinal;
+		for(; skip < nkmers; skip += draw_skip() + 1){
+			sampled_idx.push_back(skip);
 		}
+		skip -= nkmers; //the sequential debug sampler carries the remainder into the next read
+		total_kmers += nkmers;
+		file->append_kmers(kmers, k, sampled_idx);
 	}
-	return kmer; // empty
+	return kmers.size();
 }
 
-
-
-
-
-
-
-
 }
@@ -2,6 +2,7 @@
 #include "bloom.hh"
 #include "covariateutils.hh"
 #include "recalibrateutils.hh"
+#include "gatkreport.hh"
 #include <memory>
 #include <iostream>
 #include <fstream>
@@ -19,13 +20,14 @@
 #endif
 
 //opens file filename and returns a unique_ptr to the result.
-std::unique_ptr<htsiter::HTSFile> open_file(std::string filename, htsThreadPool* tp, bool is_bam = true, bool use_oq = false, bool set_oq = false){
+//every file opened in a run should share rgs.
+std::unique_ptr<htsiter::HTSFile> open_file(std::string filename, htsThreadPool* tp, readutils::ReadGroups& rgs, bool is_bam = true, bool use_oq = false, bool set_oq = false){
 	std::unique_ptr<htsiter::HTSFile> f(nullptr);
 	if(is_bam){
-		f = std::move(std::unique_ptr<htsiter::BamFile>(new htsiter::BamFile(filename, tp, use_oq, set_oq)));
+		f = std::move(std::unique_ptr<htsiter::BamFile>(new htsiter::BamFile(filename, tp, rgs, use_oq, set_oq)));
 		// f.reset(new htsiter::BamFile(filename));
 	} else {
-		f = std::move(std::unique_ptr<htsiter::FastqFile>(new htsiter::FastqFile(filename, tp)));
+		f = std::move(std::unique_ptr<htsiter::FastqFile>(new htsiter::FastqFile(filename, tp, rgs)));
 		// f.reset(new htsiter::FastqFile(filename));
 	}
 	return f;
@@ -72,6 +74,13 @@ struct option long_options[] = {
 	{"fixed",required_argument,0,'f'}, //default: none
 	{"alpha",required_argument,0,'a'}, //default: 7 / coverage
 	{"threads",required_argument,0,'t'},
+	{"cycle-exact",required_argument,0,'y'}, //cycles that each get their own key; default: 256
+	{"cycle-bin-width",required_argument,0,'w'}, //width of the bins of later cycles; 0 for log-spaced bins; default: 0
+	{"long-context",required_argument,0,'x'}, //length of an extra context covariate; 0 turns it off; default: 0
+	{"validate-fit",no_argument,0,'V'}, //check every fitted quality against an exhaustive search; default: on in debug builds
+	{"error-cache",required_argument,0,'e'}, //how many reads to remember the errors of; 0 disables; default: 65536
+	{"report",required_argument,0,'r'}, //write the counts and model as a GATK recalibration report; default: none
+	{"apply-report",required_argument,0,'R'}, //train on the counts in a GATK recalibration report instead of finding errors; default: none
 #ifndef NDEBUG
 	{"debug",required_argument,0,'d'},
 #endif
@@ -88,6 +97,12 @@ int main(int argc, char* argv[]){
 	bool use_oq = false;
 	int nthreads = 0;
 	std::string fixedinput = "";
+	size_t cache_size = 65536;
+	size_t cycle_exact = 256;
+	size_t cycle_bin_width = 0;
+	bool validate_fit = covariateutils::MAPFitter::validate_by_default;
+	std::string reportoutput = "";
+	std::string reportinput = "";
 
 	int opt = 0;
 	int opt_idx = 0;
@@ -95,7 +110,7 @@ int main(int argc, char* argv[]){
 	std::string kmerlist("");
 	std::string trustedlist("");
 #endif
-	while((opt = getopt_long(argc,argv,"k:usg:c:f:a:t:d:",long_options, &opt_idx)) != -1){
+	while((opt = getopt_long(argc,argv,"k:usg:c:f:a:t:y:w:x:Ve:r:R:d:",long_options, &opt_idx)) != -1){
 		switch(opt){
 			case 'k':
 				k = std::stoi(std::string(optarg));
@@ -118,6 +133,31 @@ int main(int argc, char* argv[]){
 			case 'f':
 				fixedinput = std::string(optarg);
 				break;
+			case 'y':
+				cycle_exact = std::stoull(std::string(optarg));
+				break;
+			case 'w':
+				cycle_bin_width = std::stoull(std::string(optarg));
+				break;
+			case 'x':
+				try{
+					covariateutils::LongContextCovariate::set_size(std::stoi(std::string(optarg)));
+				} catch(std::invalid_argument& e) {
+					return 1;
+				}
+				break;
+			case 'V':
+				validate_fit = true;
+				break;
+			case 'e':
+				cache_size = std::stoull(std::string(optarg));
+				break;
+			case 'r':
+				reportoutput = std::string(optarg);
+				break;
+			case 'R':
+				reportinput = std::string(optarg);
+				break;
 			case 'a':
 				alpha = std::stold(std::string(optarg));
 				break;
@@ -144,6 +184,12 @@ int main(int argc, char* argv[]){
 		}
 	}
 
+	try{
+		covariateutils::CycleCovariate::set_binning(cycle_exact, cycle_bin_width);
+	} catch(std::invalid_argument& e) {
+		return 1;
+	}
+
 	std::string filename("-");
 	if(optind < argc){
 		filename = std::string(argv[optind]);
@@ -189,9 +235,23 @@ int main(int argc, char* argv[]){
 		return 1;
 	}
 	std::unique_ptr<htsiter::HTSFile> file;
+	readutils::ReadGroups rgs; //read groups for every file in the run
 	covariateutils::CCovariateData data;
 
-if(fixedinput == ""){ //no fixed input provided
+if(reportinput != ""){ //use the counts in an existing report
+	if(hclose(fp) != 0){
+		std::cerr << put_now << " Error closing file!" << std::endl;
+	}
+	std::cerr << put_now << " Reading recalibration report " << reportinput << std::endl;
+	//open the input first so its read groups are numbered in header order, as usual
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
+	std::ifstream report(reportinput);
+	if(!report){
+		std::cerr << put_now << " Error opening file " << reportinput << std::endl;
+		return 1;
+	}
+	gatkreport::read_recalibration_report(report, rgs, data);
+} else if(fixedinput == ""){ //no fixed input provided
 
 	if(genomelen == 0){
 		if(is_bam){
@@ -229,7 +289,7 @@ if(fixedinput == ""){ //no fixed input provided
 		if(coverage == 0){
 			std::cerr << put_now << " Estimating coverage." << std::endl;
 			uint64_t seqlen = 0;
-			file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
+			file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
 			std::string seq("");
 			while((seq = file->next_str()) != ""){
 				seqlen += seq.length();
@@ -255,7 +315,7 @@ if(fixedinput == ""){ //no fixed input provided
 		coverage = 7.0l/alpha;
 	}
 
-	file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
 
 	std::cerr << put_now << " Sampling kmers at rate " << alpha << std::endl;
 
@@ -333,7 +393,7 @@ if(fixedinput == ""){ //no fixed input provided
 	//get trusted kmers bf using subsampled bf
 	std::cerr << put_now << " Finding trusted kmers" << std::endl;
 
-	file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
 	recalibrateutils::find_trusted_kmers(file.get(), trusted, subsampled, thresholds, k);
 
 #ifndef NDEBUG
@@ -362,26 +422,35 @@ if(trustedlist != ""){
 
 	//use trusted kmers to find errors
 	std::cerr << put_now << " Finding errors" << std::endl;
-	file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
-	data = recalibrateutils::get_covariatedata(file.get(), trusted, k);
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
+	readutils::ErrorCache cache(cache_size);
+	data = recalibrateutils::get_covariatedata(file.get(), trusted, k, nthreads, &cache);
+	if(cache_size > 0){
+		std::cerr << put_now << " Error cache: " << cache.hits() << " hits, " << cache.misses() <<
+			" misses (" << cache.uncached() << " not cacheable)" << std::endl;
+	}
 } else { //use fixedfile to find errors
 	std::cerr << put_now << " Using fixed file to find errors." << std::endl;
-	file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
-	std::unique_ptr<htsiter::HTSFile> fixedfile = std::move(open_file(fixedinput, tp.get(), is_bam, use_oq, set_oq));
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
+	std::unique_ptr<htsiter::HTSFile> fixedfile = std::move(open_file(fixedinput, tp.get(), rgs, is_bam, use_oq, set_oq));
+	readutils::CReadData read;
+	readutils::CReadData fixedread;
 	while(file->next() >= 0 && fixedfile->next() >= 0){
-		readutils::CReadData read = file->get();
-		readutils::CReadData fixedread = fixedfile->get();
-		std::transform(read.seq.begin(), read.seq.end(), fixedread.seq.begin(),
-			read.errors.begin(), std::not_equal_to<char>{});
+		file->get(read);
+		fixedfile->get(fixedread);
+		for(size_t i = 0; i < read.seq.length(); ++i){
+			read.errors[i] = read.seq.code(i) != fixedread.seq.code(i);
+		}
 		data.consume_read(read);
 	}
+	data.flush();
 }
 
 
 
-	std::vector<std::string> rgvals(readutils::CReadData::rg_to_int.size(), "");
-	for(auto i : readutils::CReadData::rg_to_int){
-		rgvals[i.second] = i.first;
+	std::vector<std::string> rgvals;
+	for(size_t i = 0; i < rgs.size(); ++i){
+		rgvals.push_back(rgs.name(i));
 	}
 
 #ifndef NDEBUG
@@ -404,8 +473,17 @@ if(trustedlist != ""){
 
 	//recalibrate reads and write to file
 	std::cerr << put_now << " Training model" << std::endl;
-	covariateutils::dq_t dqs = data.get_dqs();
-
+	covariateutils::dq_t dqs = data.get_dqs(nthreads, validate_fit);
+
+	if(reportoutput != ""){
+		std::cerr << put_now << " Writing recalibration report " << reportoutput << std::endl;
+		std::ofstream report(reportoutput);
+		gatkreport::recalibration_report(data, dqs, rgs).write(report);
+		if(!report){
+			std::cerr << put_now << " Error writing file " << reportoutput << std::endl;
+			return 1;
+		}
+	}
 
 #ifndef NDEBUG
 	std::cerr << put_now << " dqs:\n" << "meanq: ";
@@ -424,36 +502,26 @@ if(trustedlist != ""){
 			}
 		}
 	}
-	std::cerr << "cycledq:" << std::endl;
-	for(int i = 0; i < dqs.cycledq.size(); ++i){
-		for(int j = 0; j < dqs.cycledq[i].size(); ++j){
-			if(data.qcov[i][j][1] != 0){
-				for(size_t k = 0; k < dqs.cycledq[i][j].size(); ++k){
-					for(int l = 0; l < dqs.cycledq[i][j][k].size(); ++l){
-						std::cerr << rgvals[i] << ", " << "q = " << j << ", cycle = " << (k ? -(l+1) : l+1) << ": " << dqs.cycledq[i][j][k][l] << " (" <<
-							dqs.meanq[i] + dqs.rgdq[i] + dqs.qscoredq[i][j] + dqs.cycledq[i][j][k][l] << ") " << 
-							data.cycov[i][j][k][l][1] << " " << data.cycov[i][j][k][l][0] << std::endl;
+	for(size_t c = 0; c < covariateutils::ncovariates; ++c){
+		std::string name = covariateutils::covariate_name(c);
+		const covariateutils::keydq_t& covdq = dqs.covariatedq[c];
+		std::cerr << name << " dq:" << std::endl;
+		for(int i = 0; i < covdq.size(); ++i){
+			for(int j = 0; j < covdq[i].size(); ++j){
+				if(data.qcov[i][j][1] != 0){
+					for(size_t k = 0; k < covdq[i][j].size(); ++k){
+						std::cerr << rgvals[i] << ", " << "q = " << j << ", " << name << " = " << covariateutils::covariate_key_str(c, k) << ": " << covdq[i][j][k] << " (" <<
+							dqs.meanq[i] + dqs.rgdq[i] + dqs.qscoredq[i][j] + covdq[i][j][k] << ") " << 
+							data.covariates[c][i][j][k][1] << " " << data.covariates[c][i][j][k][0] << std::endl;
 					}
 				}
 			}
 		}
 	}
-	std::cerr << "dinucdq:" << std::endl;
-	for(int i = 0; i < dqs.dinucdq.size(); ++i){
-		for(int j = 0; j < dqs.dinucdq[i].size(); ++j){
-			if(data.qcov[i][j][1] != 0){
-				for(size_t k = 0; k < dqs.dinucdq[i][j].size(); ++k){
-					std::cerr << rgvals[i] << ", " << "q = " << j << ", dinuc = " << seq_nt16_str[seq_nt16_table['0' + (k >> 2)]] << seq_nt16_str[seq_nt16_table['0' + (k & 3)]] << ": " << dqs.dinucdq[i][j][k] << " (" <<
-						dqs.meanq[i] + dqs.rgdq[i] + dqs.qscoredq[i][j] + dqs.dinucdq[i][j][k] << ") " << 
-						data.dicov[i][j][k][1] << " " << data.dicov[i][j][k][0] << std::endl;
-				}
-			}
-		}
-	}
 #endif
 
 	std::cerr << put_now << " Recalibrating file" << std::endl;
-	file = std::move(open_file(filename, tp.get(), is_bam, use_oq, set_oq));
+	file = std::move(open_file(filename, tp.get(), rgs, is_bam, use_oq, set_oq));
 	recalibrateutils::recalibrate_and_write(file.get(), dqs, "-");
 	return 0;
 }
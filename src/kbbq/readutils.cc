@@ -2,23 +2,131 @@
 #include <algorithm>
 #include <iterator>
 #include <iostream>
+#include <cstring>
 
 KSEQ_DECLARE(BGZF*)
 
 namespace readutils{
 
-	std::unordered_map<std::string, std::string> CReadData::rg_to_pu{};
-	std::unordered_map<std::string, int> CReadData::rg_to_int{};
+	int ReadGroups::insert(const std::string& rg, const std::string& pu){
+		std::lock_guard<std::mutex> lock(this->mtx);
+		auto found = this->ids.find(rg);
+		if(found != this->ids.end()){
+			return found->second;
+		}
+		int id = this->names.size();
+		this->ids.emplace(rg, id);
+		this->names.push_back(rg);
+		this->pus.push_back(pu);
+		return id;
+	}
+
+	void ReadGroups::load_from_header(sam_hdr_t* header){
+		const char* text = sam_hdr_str(header);
+		if(text == NULL){
+			return;
+		}
+		std::string hdrtxt(text);
+		for(size_t linestart = 0; linestart < hdrtxt.length();){
+			size_t lineend = std::min(hdrtxt.find('\n', linestart), hdrtxt.length());
+			if(hdrtxt.compare(linestart, 4, "@RG\t") == 0){
+				std::string id("");
+				std::string pu("");
+				//fields are tab-separated TAG:VALUE
+				for(size_t fieldstart = linestart + 4; fieldstart < lineend;){
+					size_t fieldend = std::min(hdrtxt.find('\t', fieldstart), lineend);
+					if(hdrtxt.compare(fieldstart, 3, "ID:") == 0){
+						id = hdrtxt.substr(fieldstart + 3, fieldend - fieldstart - 3);
+					} else if(hdrtxt.compare(fieldstart, 3, "PU:") == 0){
+						pu = hdrtxt.substr(fieldstart + 3, fieldend - fieldstart - 3);
+					}
+					fieldstart = fieldend + 1;
+				}
+				if(id != ""){
+					this->insert(id, pu == "" ? id : pu);
+				}
+			}
+			linestart = lineend + 1;
+		}
+	}
+
+	size_t ReadGroups::size() const{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		return this->names.size();
+	}
+
+	std::string ReadGroups::name(int id) const{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		return this->names[id];
+	}
+
+	std::string ReadGroups::pu(int id) const{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		return this->pus[id];
+	}
+
+	int ReadGroups::find_pu(const std::string& pu) const{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		auto found = std::find(this->pus.begin(), this->pus.end(), pu);
+		return found == this->pus.end() ? -1 : found - this->pus.begin();
+	}
+
+	void PackedSeq::reset(size_t n){
+		this->len = n;
+		this->bases.assign((n + 31) / 32, 0);
+		this->nmask.assign((n + 63) / 64, 0);
+	}
+
+	void PackedSeq::assign(const char* s, size_t n){
+		this->reset(n);
+		for(size_t i = 0; i < n; ++i){
+			this->set(i, s[i]);
+		}
+	}
+
+	std::string PackedSeq::str(size_t pos, size_t count) const{
+		size_t end = count < this->len - pos ? pos + count : this->len;
+		std::string ret(end - pos, 'N');
+		for(size_t i = pos; i < end; ++i){
+			ret[i - pos] = (*this)[i];
+		}
+		return ret;
+	}
+
+	void PackedSeq::str(std::string& out) const{
+		out.resize(this->len);
+		for(size_t i = 0; i < this->len; ++i){
+			out[i] = (*this)[i];
+		}
+	}
+
+	PackedSeq PackedSeq::substr(size_t pos, size_t count) const{
+		size_t end = count < this->len - pos ? pos + count : this->len;
+		PackedSeq ret;
+		ret.reset(end - pos);
+		for(size_t i = pos; i < end; ++i){
+			ret.set_code(i - pos, this->code(i));
+		}
+		return ret;
+	}
+
+	CReadData::CReadData(bam1_t* bamrecord, ReadGroups& rgs, bool use_oq){
+		this->fill(bamrecord, rgs, use_oq);
+	}
+
+	CReadData::CReadData(kseq::kseq_t* fastqrecord, ReadGroups& rgs, std::string rg, int second, std::string namedelimiter){
+		this->fill(fastqrecord, rgs, rg, second, namedelimiter);
+	}
 
-	CReadData::CReadData(bam1_t* bamrecord, bool use_oq){ //TODO: flag to use OQ
-		this->name = bam_get_qname(bamrecord);
-		this->seq = bam_seq_str(bamrecord);
+	BamReadView::BamReadView(const bam1_t* bamrecord, bool use_oq): r(bamrecord), s(bam_get_seq(bamrecord)),
+		q(bam_get_qual(bamrecord)), qoffset(0), len(bamrecord->core.l_qseq), rev(bam_is_rev(bamrecord))
+	{
 		if(use_oq){
 			const uint8_t* oqdata = bam_aux_get(bamrecord, "OQ"); // this will be null on error
 			//we should throw in that case
 			if(oqdata == NULL){
 				std::cerr << "Error: --use-oq was specified but unable to read OQ tag " << 
-				"on read " << this->name << std::endl;
+				"on read " << this->name() << std::endl;
 				if(errno == ENOENT){
 					std::cerr << "OQ not found. Try again without the --use-oq option." << std::endl;
 				} else if(errno == EINVAL){
@@ -26,121 +134,135 @@ namespace readutils{
 				}
 				throw std::invalid_argument("Unable to read OQ tag.");
 			}
-			const std::string oq = bam_aux2Z(oqdata);
-			std::transform(oq.cbegin(), oq.cend(), std::back_inserter(this->qual),
-				[](const char& c) -> uint8_t {return c - 33;});
-		} else {
-			std::copy(bam_get_qual(bamrecord), bam_get_qual(bamrecord) + bamrecord->core.l_qseq,
-				std::back_inserter(this->qual));
-		}
-		if(bam_is_rev(bamrecord)){
-			//seq is already in fwd orientation
-			std::reverse(this->qual.begin(), this->qual.end());
-		}
-		this->skips.resize(bamrecord->core.l_qseq, 0);
-		uint8_t* rgdata = bam_aux_get(bamrecord, "RG");
-		if(rgdata == NULL){
-			std::cerr << "Error: Unable to read RG tag on read " << this->name << std::endl;
-			if(errno == ENOENT){
-				std::cerr << "RG not found. " <<
-				"Every read in the BAM must have an RG tag; add tags with " <<
-				"samtools addreplacerg and try again." << std::endl;
-			} else if(errno == EINVAL){
-				std::cerr << "Tag data is corrupt. Repair the tags and try again." << std::endl;
+			//the type of the tag is its first byte (what bam_aux_type returns in newer htslib)
+			const char* oq = *oqdata == 'Z' ? bam_aux2Z(oqdata) : NULL;
+			if(oq == NULL || std::strlen(oq) != this->len){
+				std::cerr << "Error: --use-oq was specified but the OQ tag on read " << this->name() <<
+					(oq == NULL ? " is not a string." : " doesn't have one quality per base.") << std::endl;
+				std::cerr << "Tag data is corrupt. Repair the tags or try again without the --use-oq option." << std::endl;
+				throw std::invalid_argument("Unable to read OQ tag.");
+			}
+			this->q = (const uint8_t*)oq;
+			this->qoffset = 33;
+		}
+	}
+
+	const char* BamReadView::rg() const{
+		if(this->rgtag == NULL){
+			uint8_t* rgdata = bam_aux_get(this->r, "RG");
+			if(rgdata == NULL){
+				std::cerr << "Error: Unable to read RG tag on read " << this->name() << std::endl;
+				if(errno == ENOENT){
+					std::cerr << "RG not found. " <<
+					"Every read in the BAM must have an RG tag; add tags with " <<
+					"samtools addreplacerg and try again." << std::endl;
+				} else if(errno == EINVAL){
+					std::cerr << "Tag data is corrupt. Repair the tags and try again." << std::endl;
+				}
+				throw std::invalid_argument("Unable to read RG tag.");;
 			}
-			throw std::invalid_argument("Unable to read RG tag.");;
+			this->rgtag = bam_aux2Z(rgdata);
 		}
-		this->rg = bam_aux2Z(bam_aux_get(bamrecord, "RG"));
-		if(rg_to_pu.count(this->rg) == 0){
-			rg_to_int[this->rg] = rg_to_int.size();
-			// we just need something unique here.
-			rg_to_pu[this->rg] = rg; //when loaded from the header this is actually a PU 
+		return this->rgtag;
+	}
+
+	void CReadData::fill(bam1_t* bamrecord, ReadGroups& rgs, bool use_oq){
+		BamReadView view(bamrecord, use_oq);
+		this->fill(view, rgs.id(view.rg()));
+	}
+
+	void CReadData::fill(const BamReadView& view, int rgid){
+		size_t len = view.length();
+		this->name = view.name();
+		this->seq.reset(len);
+		this->qual.resize(len);
+		for(size_t i = 0; i < len; ++i){
+			this->seq.set_code(i, view.code(i));
+			this->qual[i] = view.qual(i);
 		}
-		this->second = bamrecord->core.flag & BAM_FREAD2; // 0x80
-		this->errors.resize(bamrecord->core.l_qseq,0);
+		this->skips.assign(len, false);
+		this->errors.assign(len, false);
+		this->rg = view.rg();
+		this->rgid = rgid;
+		this->second = view.second();
 	}
+
 	// if second is >1, that means infer.
 
-	CReadData::CReadData(kseq::kseq_t* fastqrecord, std::string rg, int second, std::string namedelimiter):
-	seq(fastqrecord->seq.s), skips(seq.length(), false), errors(seq.length(), false)
+	FastqHeader::FastqHeader(const kseq::kseq_t* fastqrecord, const std::string& namedelimiter):
+		name(fastqrecord->name.s), mate(0), rg(""), rg_len(0)
 	{
-		// this->seq = std::string(fastqrecord->seq.s);
-		// this->qual.assign(fastqrecord->qual.s, fastqrecord->qual.l);
-		std::string quals(fastqrecord->qual.s);
-		std::transform(quals.begin(), quals.end(), std::back_inserter(this->qual),
-			[](char c) -> int {return c - 33;});
-		// this->skips.resize(this->seq.length(), false);
-
-		std::string fullname(fastqrecord->name.s);
-		size_t current_pos = fullname.find(namedelimiter);
-		std::string first_name = fullname.substr(0, current_pos);
-
-		while(rg == "" && current_pos != std::string::npos){
-			// if we need to find rg
-			fullname = fullname.substr(current_pos+1); //get the right part, excluding the delimiter
-			current_pos = fullname.find(namedelimiter); //reset the delimiter; this is npos if no more fields
-			if(fullname.substr(0,3) == "RG:"){
-				size_t last_colon = fullname.find_last_of(":", current_pos); // current_pos is last char to search
-				rg = fullname.substr(last_colon+1, current_pos);
+		const char* end = this->name + fastqrecord->name.l;
+		auto next_delim = [&](const char* field) -> const char* {
+			return namedelimiter.empty() ? end :
+				std::search(field, end, namedelimiter.begin(), namedelimiter.end());
+		};
+		const char* field_end = next_delim(this->name);
+		this->name_len = field_end - this->name;
+		if(this->name_len >= 2 && this->name[this->name_len - 2] == '/' &&
+			(this->name[this->name_len - 1] == '1' || this->name[this->name_len - 1] == '2')){
+			this->mate = this->name[this->name_len - 1] - '0';
+		}
+		bool found = false;
+		while(!found && field_end != end){
+			const char* field = field_end + namedelimiter.length();
+			field_end = next_delim(field);
+			found = this->set_rg(field, field_end);
+		}
+		//tags can also be in the comment, separated by whitespace (samtools fastq -T RG)
+		if(!found && fastqrecord->comment.l > 0){
+			const char* comment_end = fastqrecord->comment.s + fastqrecord->comment.l;
+			for(const char* field = fastqrecord->comment.s; !found && field < comment_end; field = field_end + 1){
+				field_end = std::find_if(field, comment_end, [](char c) -> bool {return c == ' ' || c == '\t';});
+				found = this->set_rg(field, field_end);
 			}
 		}
-		this->rg = rg;
+	}
+
+	bool FastqHeader::set_rg(const char* field, const char* field_end){
+		if(field_end - field <= 3 || std::strncmp(field, "RG:", 3) != 0){
+			return false;
+		}
+		//the value is everything after the last colon; there's always one at field[2].
+		const char* value = field_end;
+		while(*(value - 1) != ':'){
+			--value;
+		}
+		if(value == field_end){
+			return false;
+		}
+		this->rg = value;
+		this->rg_len = field_end - value;
+		return true;
+	}
 
+	void CReadData::fill(kseq::kseq_t* fastqrecord, ReadGroups& rgs, std::string rg, int second, std::string namedelimiter){
+		FastqHeader header(fastqrecord, namedelimiter);
+		if(rg != ""){
+			header.rg = rg.c_str();
+			header.rg_len = rg.length();
+		}
+		this->fill(fastqrecord, header, rgs.id(std::string(header.rg, header.rg_len)), second);
+	}
+
+	void CReadData::fill(kseq::kseq_t* fastqrecord, const FastqHeader& header, int rgid, int second){
+		this->seq.assign(fastqrecord->seq.s, fastqrecord->seq.l);
+		this->skips.assign(this->seq.length(), false);
+		this->errors.assign(this->seq.length(), false);
+		this->qual.resize(fastqrecord->qual.l);
+		std::transform(fastqrecord->qual.s, fastqrecord->qual.s + fastqrecord->qual.l, this->qual.begin(),
+			[](char c) -> int {return c - 33;});
+		size_t name_len = header.name_len;
 		if(second > 1){
-			std::string tail = first_name.substr(first_name.length() - 2);
-			second = (tail == "/2");
-			if(second || tail == "/1"){
-				first_name = first_name.substr(0, first_name.length() - 2);
+			second = (header.mate == 2);
+			if(header.mate != 0){
+				name_len -= 2;
 			}
 		}
-		this->name = first_name;
+		this->name.assign(header.name, name_len);
 		this->second = second;
-		// this->errors.resize(this->seq.length(), false);
-
-		if(rg_to_pu.count(this->rg) == 0){
-			rg_to_int[this->rg] = rg_to_int.size();
-			rg_to_pu[this->rg] = rg; //when loaded from the header this is actually a PU.
-		}
-	}
-
-	void CReadData::load_rgs_from_bamfile(bam_hdr_t* header){
-		std::string hdrtxt(header->text);
-		size_t linedelim = hdrtxt.find('\n');
-		// kstring_t val;
-		// while (sam_hdr_find_tag_pos(header, "RG", i, "ID", val) == 0){
-		// 	std::string rgid(val.s);
-		// 	sam_hdr_find_tag_pos(header, "RG", i, "PU", val);
-		// 	std::string pu(val.s);
-		// 	if(rg_to_pu.count(rgid) == 0){
-		// 		rg_to_int[rgid] = rg_to_int.size();
-		// 		rg_to_pu[rgid] = pu;
-		// 	}
-		// }
-		while(linedelim != std::string::npos){
-			if(hdrtxt.substr(0,3) == "@RG"){
-				std::string id("");
-				std::string pu("");
-				std::string line = hdrtxt.substr(0, linedelim);
-				size_t tokendelim = line.find_first_of("\t ");
-				while(tokendelim != std::string::npos){
-					if(line.substr(0,3) == "ID:"){
-						//id
-						id = line.substr(4, tokendelim);
-					} else if (line.substr(0, 3) == "PU:"){
-						//pu
-						pu = line.substr(4, tokendelim);
-					}
-					line = line.substr(tokendelim);
-					tokendelim = line.find_first_of("\t ");
-				}
-				if(id != ""){
-					rg_to_int[id] = rg_to_int.size();
-					rg_to_pu[id] = pu;
-				}
-			}
-			hdrtxt = hdrtxt.substr(linedelim);
-			linedelim = hdrtxt.find('\n');
-		}
+		this->rg.assign(header.rg, header.rg_len);
+		this->rgid = rgid;
 	}
 
 	std::string CReadData::str_qual(){
@@ -171,119 +293,224 @@ namespace readutils{
 	}
 
 	void CReadData::infer_read_errors(const bloom::Bloom& b, const std::vector<int>& thresholds, int k){
-		std::array<std::vector<size_t>,2> overlapping = bloom::overlapping_kmers_in_bf(this->seq, b, k);
-		std::vector<size_t> in = overlapping[0];
-		std::vector<size_t> possible = overlapping[1];
-		for(size_t i = 0; i < errors.size(); ++i){
-			this->errors[i] = (in[i] <= thresholds[possible[i]] || this->qual[i] <= INFER_ERROR_BAD_QUAL);
+		std::vector<bloom::Kmer> kmers;
+		bloom::Kmer kmer(k);
+		for(size_t i = 0; i < this->seq.length(); ++i){
+			kmer.push_back_int(this->seq.code(i));
+			if(i >= k - 1){
+				kmers.push_back(kmer);
+			}
+		}
+		this->infer_read_errors(kmers, b, thresholds, k);
+	}
+
+	void CReadData::infer_read_errors(const std::vector<bloom::Kmer>& kmers, const bloom::Bloom& b, const std::vector<int>& thresholds, int k){
+		std::array<std::vector<size_t>,2> overlapping = bloom::overlapping_kmers_in_bf(kmers, this->qual.size(), b, k);
+		this->infer_read_errors(overlapping, thresholds, k);
+	}
+
+	void CReadData::infer_read_errors(const std::array<std::vector<size_t>,2>& overlapping, const std::vector<int>& thresholds, int k){
 #ifndef NDEBUG
-			if(possible[i] > k){std::cerr << "seq:" << this->seq << " " << possible[i] << "WARNING: Invalid i: " << i << std::endl;}
-			// if(i>=k-1 && std::string(this->seq, i-k+1, k) == "CCCCCCCCCTCGCCCCCCCCCCCCCCCCCCC"){
-			// 	std::cerr << "seq: " << this->seq << "\n";
-			// 	std::cerr << "in: ";
-			// 	std::copy(in.begin()+i-k+1, in.begin()+i+1, std::ostream_iterator<size_t>(std::cerr, ", "));
-			// 	std::cerr << "\npossible: ";
-			// 	std::copy(possible.begin()+i-k+1, possible.begin()+i+1, std::ostream_iterator<size_t>(std::cerr, ", "));
-			// 	std::cerr << "\nerrors: ";
-			// 	std::copy(this->errors.begin()+i-k+1, this->errors.begin()+i+1, std::ostream_iterator<bool>(std::cerr, ", "));
-			// 	std::cerr << std::endl;
-			// }			
+		for(size_t i = 0; i < this->errors.size(); ++i){
+			if(overlapping[1][i] > k){std::cerr << "seq:" << this->seq.str() << " " << overlapping[1][i] << "WARNING: Invalid i: " << i << std::endl;}
+		}
 #endif
+		infer_errors(overlapping, this->qual, thresholds, k, this->errors);
+	}
+
+	void CReadData::infer_errors(const std::array<std::vector<size_t>,2>& overlapping, const std::vector<uint8_t>& qual,
+		const std::vector<int>& thresholds, int k, std::vector<bool>& errors)
+	{
+		const std::vector<size_t>& in = overlapping[0];
+		const std::vector<size_t>& possible = overlapping[1];
+		for(size_t i = 0; i < errors.size(); ++i){
+			errors[i] = (in[i] <= thresholds[possible[i]] || qual[i] <= INFER_ERROR_BAD_QUAL);
 		}
 	}
 
 	size_t CReadData::correct_one(const bloom::Bloom& t, int k){
+		std::string seq = this->seq.str();
+		size_t fixed = correct_one(&seq[0], seq.length(), this->qual.data(), t, k);
+		if(fixed != std::string::npos){
+			this->seq.set(fixed, seq[fixed]);
+		}
+		return fixed;
+	}
+
+	size_t CReadData::correct_one(char* seq, size_t len, const uint8_t* qual, const bloom::Bloom& t, int k){
+		static thread_local CorrectionScratch scratch;
+		return correct_one(seq, len, qual, t, k, scratch);
+	}
+
+	//seq isn't changed while the substitutions are tested. the kmers of the read are
+	//built once; a kmer with one base substituted is then a couple of bit operations
+	//(see bloom::Kmer::substitution), and the kmers around each candidate are queried
+	//together so their lookups can be prefetched.
+	size_t CReadData::correct_one(char* seq, size_t len, const uint8_t* qual, const bloom::Bloom& t, int k,
+		CorrectionScratch& scratch)
+	{
 		int best_fix_len = 0;
 		char best_fix_base;
 		size_t best_fix_pos = std::string::npos;
-		for(size_t i = 0; i < this->seq.length(); ++i){
-			std::string original_seq(this->seq); //copy original
-			for(const char& c : {'A','C','G','T'}){
-				if(this->seq[i] == c){continue;}
-				original_seq[i] = c;
-				size_t start = i > k - 1 ? i - k + 1 : 0;
-				//test a kmer to see whether its worth counting them all
-				//i'm not sure any performance gain is worth it, but this is how Lighter does it
-				size_t magic_start = i > k/2 - 1 ? std::min(i - k/2 + 1, original_seq.length()-k) : 0;
-				bloom::Kmer magic_kmer(k);
-				for(size_t j = magic_start; j <= magic_start + k - 1; ++j){
-					magic_kmer.push_back(original_seq[j]);
-				}
-				//
-				if(t.query(magic_kmer)){
-					//94518
-					int n_in = bloom::biggest_consecutive_trusted_block(
-						original_seq.substr(start, 2*k - 1),t,k,best_fix_len);
-#ifndef NDEBUG					
-					std::cerr << "Found a kmer: " << magic_kmer << " i: " << i << " Fix len: " << n_in << std::endl;
+		if(len < k){ //no kmer can be trusted
+			return best_fix_pos;
+		}
+		std::vector<bloom::Kmer>& kmer_at = scratch.kmer_at;
+		std::vector<uint8_t>& n_count = scratch.n_count;
+		kmer_at.clear();
+		n_count.clear();
+		bloom::Kmer kmer(k);
+		uint8_t ns = 0;
+		for(size_t i = 0; i < len; ++i){
+			int c = seq_nt16_int[seq_nt16_table[seq[i]]];
+			kmer.push_back_int(c < 4 ? c : 0);
+			ns += c > 3;
+			if(i >= k){
+				ns -= seq_nt16_int[seq_nt16_table[seq[i - k]]] > 3;
+			}
+			if(i >= k - 1){
+				kmer_at.push_back(kmer);
+				n_count.push_back(ns);
+			}
+		}
+		std::array<std::pair<size_t,size_t>, KBBQ_MAX_KMER> locs;
+		std::array<bool, KBBQ_MAX_KMER> valid;
+		for(size_t i = 0; i < len; ++i){
+			const char original_base = seq[i];
+			const int original_n = seq_nt16_int[seq_nt16_table[original_base]] > 3;
+			//test a kmer to see whether its worth counting them all
+			//i'm not sure any performance gain is worth it, but this is how Lighter does it
+			//all 4 versions of the kmer containing i are queried at once.
+			size_t magic_start = i > k/2 - 1 ? std::min(i - k/2 + 1, len-k) : 0;
+			uint8_t magic_trusted = n_count[magic_start] == original_n ?
+				t.query_mask(kmer_at[magic_start].substitutions(i - magic_start)) : 0;
+			//the kmers within k of i; the ones after i only exist near the start of the read.
+			size_t start = i > k - 1 ? i - k + 1 : 0;
+			size_t last = std::min(start + k - 1, len - k);
+			for(int c_int = 0; c_int < 4; ++c_int){
+				char c = "ACGT"[c_int];
+				if(original_base == c){continue;}
+				if(magic_trusted & (1 << c_int)){
+					for(size_t j = start; j <= last; ++j){
+						bool contains_i = j <= i && j + k > i;
+						valid[j - start] = n_count[j] == (contains_i ? original_n : 0);
+						if(valid[j - start]){
+							locs[j - start] = t.bloom.locate(contains_i ?
+								kmer_at[j].substitution(i - j, c_int) : kmer_at[j].get());
+							t.bloom.prefetch(locs[j - start]);
+						}
+					}
+					//the longest run of trusted kmers
+					int n_in = 0;
+					int in = 0;
+					for(size_t j = start; j <= last; ++j){
+						if(valid[j - start] && t.bloom.contains_at(locs[j - start])){
+							n_in = std::max(n_in, ++in);
+						} else {
+							in = 0;
+						}
+					}
+#ifndef NDEBUG
+					std::cerr << "Found a kmer: " << kmer_at[magic_start] << " i: " << i << " Fix len: " << n_in << std::endl;
 #endif
 					if(n_in > best_fix_len){ //94518
 						best_fix_base = c;
 						best_fix_pos = i;
 						best_fix_len = n_in;
-					} else if(n_in == best_fix_len && this->qual[i] < this->qual[best_fix_pos]){
-						best_fix_base = c;
-						best_fix_pos = i;
+					} else if(n_in == best_fix_len){
+						scratch.quality_tie = true;
+						if(qual[i] < qual[best_fix_pos]){
+							best_fix_base = c;
+							best_fix_pos = i;
+						}
 					}
 				}
 			}
 		}
 		if(best_fix_len > 0){
-			this->seq[best_fix_pos] = best_fix_base;
+			seq[best_fix_pos] = best_fix_base;
 		}
 		return best_fix_pos;
 	}
 
+	const std::vector<bool>& CReadData::get_errors(const bloom::Bloom& trusted, int k, int minqual, bool first_call){
+		static thread_local CorrectionScratch scratch;
+		return this->get_errors(trusted, k, scratch, minqual, first_call);
+	}
+
+	const std::vector<bool>& CReadData::get_errors(const bloom::Bloom& trusted, int k, CorrectionScratch& scratch, int minqual, bool first_call){
+		scratch.quality_tie = false;
+		scratch.kmers.fill(this->seq, trusted, k);
+		if(scratch.kmers.all()){ //nothing to correct
+			return this->errors;
+		}
+		this->seq.str(scratch.seq);
+		this->find_errors(trusted, k, minqual, first_call, 0, scratch.seq.length(), scratch);
+		return this->errors;
+	}
+
 	//this is a chonky boi
-	std::vector<bool> CReadData::get_errors(const bloom::Bloom& trusted, int k, int minqual, bool first_call){
-		std::string original_seq(this->seq);
+	void CReadData::find_errors(const bloom::Bloom& trusted, int k, int minqual, bool first_call,
+		size_t offset, size_t len, CorrectionScratch& scratch)
+	{
+		//everything below is relative to offset.
+		char* seq = &scratch.seq[offset];
+		const uint8_t* qual = this->qual.data() + offset;
+		std::vector<bool>::iterator errors = this->errors.begin() + offset;
+		//recursive calls come after this is last used, so they can share it.
+		std::string& original_seq = scratch.original;
+		original_seq.assign(seq, len);
 		size_t bad_prefix = 0;
 		size_t bad_suffix = std::string::npos;
 		bool multiple = false; //whether there were any ties
 #ifndef NDEBUG
 		std::cerr << "Correcting seq: " << original_seq << std::endl;
 #endif
-		std::array<size_t,2> anchor = bloom::find_longest_trusted_seq(this->seq, trusted, k);
+		//scratch.kmers holds the trust of the kmers of original_seq, except around corrected_idx.
+		std::array<size_t,2> anchor = bloom::find_longest_trusted_seq(scratch.kmers, offset, len, k);
 #ifndef NDEBUG
 		std::cerr << "Initial anchors: [" << anchor[0] << ", " << anchor[1] << "]" << std::endl;
 #endif
+		size_t corrected_idx = std::string::npos;
 		if(anchor[0] == std::string::npos){ //no trusted kmers in this read.
 			multiple = true;
-			size_t corrected_idx = this->correct_one(trusted, k);
+			corrected_idx = correct_one(seq, len, qual, trusted, k, scratch);
 			if(corrected_idx == std::string::npos){
-				return this->errors;
+				return;
 			} else {
-				anchor = bloom::find_longest_trusted_seq(this->seq, trusted, k);
+				scratch.kmers.requery(bloom::SeqView(scratch.seq), trusted, k, offset + corrected_idx);
+				anchor = bloom::find_longest_trusted_seq(scratch.kmers, offset, len, k);
 #ifndef	NDEBUG
 				std::cerr << "Created anchor: [" << anchor[0] << ", " << anchor[1] << "]" << std::endl;
 #endif				
-				this->errors[corrected_idx] = true;
+				errors[corrected_idx] = true;
 			}
 		}
 		if(anchor[0] == 0 && anchor[1] == std::string::npos){ //all kmers are trusted
-			return this->errors;
+			return;
 		}
 		//we're guaranteed to have a valid anchor now.
 		//min is in case anchor[1] is npos.
-		size_t anchor_len = std::min(anchor[1], this->seq.length()-1) + 1 - anchor[0];
+		size_t anchor_len = std::min(anchor[1], len-1) + 1 - anchor[0];
 		bool corrected = false; //whether there were any corrections
 		//right side
 		if(anchor[1] != std::string::npos){
 			//number of trusted kmers >= k
 			if(anchor_len - k + 1 >= k){ //number of trusted kmers 
 				bool current_multiple;
-				std::tie(anchor[1], current_multiple) = bloom::adjust_right_anchor(anchor[1], this->seq, trusted, k);
+				std::tie(anchor[1], current_multiple) = bloom::adjust_right_anchor(anchor[1], bloom::SeqView(seq, len), trusted, k);
 #ifndef NDEBUG
 				std::cerr << "Adjust R Multiple: " << current_multiple << std::endl;
 #endif
 				multiple = multiple || current_multiple;
 			}
-			for(size_t i = anchor[1] + 1; i < this->seq.length();){
+			std::vector<char>& fix = scratch.fixes;
+			for(size_t i = anchor[1] + 1; i < len;){
 				size_t start = i - k + 1; //seq containing all kmers that are affected
-				std::vector<char> fix;
 				size_t fixlen;
 				bool current_multiple;
-				std::tie(fix, fixlen, current_multiple) = bloom::find_longest_fix(this->seq.substr(start, std::string::npos), trusted, k);
+				bloom::TrustedKmersView known{&scratch.kmers, offset + start, false};
+				std::tie(fixlen, current_multiple) = bloom::find_longest_fix(bloom::SeqView(seq, len).substr(start), trusted, k, fix, false, &known);
 #ifndef NDEBUG
 				std::cerr << "R fix Multiple: " << current_multiple << std::endl;
 #endif
@@ -299,7 +526,7 @@ namespace readutils{
 						//if( maxTo <= to || to - i + 1 < kmerLength ) ...
 						//i + k
 						multiple = true;
-						size_t largest_possible_idx = std::min(i + k - 1, this->seq.length()-1);
+						size_t largest_possible_idx = std::min(i + k - 1, len-1);
 #ifndef NDEBUG
 						std::cerr << "next_untrusted_idx: " << next_untrusted_idx << std::endl;
 						std::cerr << "largest_possible_idx (to): " << largest_possible_idx << std::endl;
@@ -321,8 +548,8 @@ namespace readutils{
 							break;
 						}
 					} else {
-						this->seq[i] = fix[0];
-						this->errors[i] = true;
+						seq[i] = fix[0];
+						errors[i] = true;
 					}
 					corrected = true;
 #ifndef NDEBUG
@@ -348,9 +575,9 @@ namespace readutils{
 		if(anchor[0] != 0){
 			//the bad base is at anchor[0]-1, then include the full kmer for that base.
 			// std::string sub = this->seq.substr(0, anchor[0] - 1 + k);
-			std::string revcomped(this->seq.length(), 'N');
-			std::transform(this->seq.rbegin(), this->seq.rend(), revcomped.begin(),
-				[](char c) -> char {return seq_nt16_str[seq_nt16_table[('0' + 3-seq_nt16_int[seq_nt16_table[c]])]];});
+			//the left side is corrected as the right side of the reverse complement.
+			//fixes are complemented back and written into seq.
+			bloom::SeqView revcomped = bloom::SeqView(seq, len).revcomp();
 			//if num of trusted kmers >= k, see if anchor needs adjusting.
 			if(anchor_len - k + 1 >= k){ 
 				size_t left_adjust;
@@ -367,11 +594,12 @@ namespace readutils{
 				int j = revcomped.length()-i-1; //index of erroneous base in reversed seq
 				size_t start = j - k + 1; //seq containing all kmers that are affected
 				//but [j -k + 1, npos) in reverse space.
-				std::string sub = revcomped.substr(start, std::string::npos); //get the right subsequence
-				std::vector<char> fix;
+				bloom::SeqView sub = revcomped.substr(start); //get the right subsequence
+				std::vector<char>& fix = scratch.fixes;
 				size_t fixlen;
 				bool current_multiple;
-				std::tie(fix, fixlen, current_multiple) = bloom::find_longest_fix(sub, trusted, k, true); //155392 TODO: add reverse_test to adjust_right_anchor
+				bloom::TrustedKmersView known{&scratch.kmers, offset + len - k - start, true};
+				std::tie(fixlen, current_multiple) = bloom::find_longest_fix(sub, trusted, k, fix, true, &known); //155392 TODO: add reverse_test to adjust_right_anchor
 #ifndef NDEBUG
 				std::cerr << "L Fix Multiple: " << current_multiple << std::endl;
 #endif
@@ -396,8 +624,8 @@ namespace readutils{
 							break;
 						}
 					} else {
-						revcomped[j] = fix[0];
-						this->errors[i] = true;
+						seq[i] = bloom::complement(fix[0]);
+						errors[i] = true;
 					}
 					corrected = true;
 #ifndef NDEBUG
@@ -434,7 +662,9 @@ namespace readutils{
 			size_t trusted_end = std::string::npos;
 			for(size_t i = 0; i < original_seq.length() && adjust == true; ++i){
 				kmer.push_back(original_seq[i]);
-				if(kmer.valid() && trusted.query(kmer)){
+				//only the kmers containing corrected_idx changed since the bitmap was filled
+				if(kmer.valid() && (i >= corrected_idx && i < corrected_idx + k ?
+					trusted.query(kmer) : scratch.kmers[offset + i + 1 - k])){
 					trusted_start = std::min(trusted_start,i-k+1);
 					trusted_end = i;
 					// std::cerr << "Trusted: " << trusted_start << " " << trusted_end << std::endl;
@@ -442,7 +672,7 @@ namespace readutils{
 					if(i > trusted_end){
 						//we clear everything from beginning to end
 						for(size_t j = trusted_start; j <= trusted_end; ++j){
-							if(this->errors[j]){
+							if(errors[j]){
 								adjust = false;
 								break;
 							}
@@ -470,11 +700,11 @@ namespace readutils{
 			// std::cerr << "Read corrected. Adjust threshold? " << adjust << std::endl;
 #ifndef NDEBUG
 			std::cerr << "Errors before adjustment: ";
-			for(const bool& b: this->errors){
-				std::cerr << b;
+			for(size_t i = 0; i < len; ++i){
+				std::cerr << errors[i];
 			}
 			std::cerr << std::endl;
-			std::cerr << "Seq After Correction: " << seq << std::endl;
+			std::cerr << "Seq After Correction: " << std::string(seq, len) << std::endl;
 #endif
 			int ocwindow = 20;
 			int base_threshold = 4;
@@ -483,31 +713,31 @@ namespace readutils{
 			//check for overcorrection
 			std::vector<int> overcorrected_idx; //push_back overcorrected indices in order
 			//then from overcorrected.begin() - k to overcorrected.end() + k should all be reset.
-			for(int i = 0; i < this->seq.length(); ++i){
-				if(this->errors[i] && seq_nt16_int[seq_nt16_table[original_seq[i]]] < 4){ //increment correction count
-					if(this->qual[i] <= minqual){
+			for(int i = 0; i < len; ++i){
+				if(errors[i] && seq_nt16_int[seq_nt16_table[original_seq[i]]] < 4){ //increment correction count
+					if(qual[i] <= minqual){
 						occount += 0.5;
 					} else {
 						++occount;
 					}
 				}
-				if(i >= ocwindow && this->errors[i-ocwindow] && seq_nt16_int[seq_nt16_table[original_seq[i-ocwindow]]] < 4){ //decrement count for not in window
-					if(this->qual[i-ocwindow] <= minqual){
+				if(i >= ocwindow && errors[i-ocwindow] && seq_nt16_int[seq_nt16_table[original_seq[i-ocwindow]]] < 4){ //decrement count for not in window
+					if(qual[i-ocwindow] <= minqual){
 						occount -= 0.5;
 					} else {
 						--occount;
 					}
 				}
 				//set threshold
-				threshold = adjust && i >= ocwindow && i + ocwindow - 1 < this->seq.length() ? 
+				threshold = adjust && i >= ocwindow && i + ocwindow - 1 < len ? 
 					base_threshold + 1 : base_threshold;
 				//determine if overcorrected
 #ifndef NDEBUG
 				std::cerr << "Occount: " << occount << " Threshold: " << threshold;
 				std::cerr << " Seq: " << original_seq[i] << " (" << seq_nt16_int[seq_nt16_table[original_seq[i]]];
-				std::cerr << ")" << " Q: " << +this->qual[i] << std::endl;
+				std::cerr << ")" << " Q: " << +qual[i] << std::endl;
 #endif
-				if(occount > threshold && this->errors[i]){
+				if(occount > threshold && errors[i]){
 					overcorrected_idx.push_back(i);
 				}
 
@@ -519,20 +749,20 @@ namespace readutils{
 #endif
 			//Line num: 23026
 			for(int oc_idx : overcorrected_idx){
-				if(this->errors[oc_idx]){ //overcorrected idx hasn't been addressed yet
+				if(errors[oc_idx]){ //overcorrected idx hasn't been addressed yet
 					int start = oc_idx-k+1; //the beginningmost position to check
 					start = start >= 0? start : 0;
 					int end = oc_idx+k; //the endmost position to check
-					end = end < this->seq.length() ? end : this->seq.length();
+					end = end < len ? end : len;
 					//we start iteration but we need to unfix anything within k of an overcorrected position
 					//OR within k of one of those fixed positions.
 					for(int i = start; i < end; ++i){
-						if(this->errors[i]){
-							this->errors[i] = false;
+						if(errors[i]){
+							errors[i] = false;
 							//changint the end must come before the start change because the start
 							//change changes i!
 							if(i+k > end){ //change the end if we need to
-								end = i+k < this->seq.length() ? i+k : this->seq.length();
+								end = i+k < len ? i+k : len;
 							}
 							//i will be 1 greater than start, so rather than i-k+1 we have i-k.
 							if(i-k < start){ //go back a bit if we need to; +1 comes from the loop
@@ -544,54 +774,116 @@ namespace readutils{
 				}
 			}
 		}
-		if(first_call && bad_prefix > 0 && (bad_prefix >= this->seq.length() / 2 || bad_prefix >= 2*k)){
+		if(first_call && bad_prefix > 0 && (bad_prefix >= len / 2 || bad_prefix >= 2*k)){
 #ifndef NDEBUG			
 			std::cerr << "bad_prefix: " << bad_prefix << std::endl;
 #endif
-			CReadData subread = this->substr(0, bad_prefix+1); //2nd argument is length
-			std::vector<bool> suberrors = subread.get_errors(trusted, k, minqual, false);
-			std::copy(suberrors.begin(), suberrors.end(), this->errors.begin());
+			//correct [0, bad_prefix] as if it were its own read.
+			this->find_errors(trusted, k, minqual, false, offset, bad_prefix+1, scratch);
 		}
-		if(first_call && bad_suffix < std::string::npos && bad_suffix < this->seq.length() &&
-		(this->seq.length()-bad_suffix > this->seq.length()/2 || this->seq.length()-bad_suffix > 2*k)){
+		if(first_call && bad_suffix < std::string::npos && bad_suffix < len &&
+		(len-bad_suffix > len/2 || len-bad_suffix > 2*k)){
 #ifndef NDEBUG
 			std::cerr << "bad_suffix: " << bad_suffix << std::endl;
 #endif
-			CReadData subread = this->substr(bad_suffix, std::string::npos);
-			std::vector<bool> suberrors = subread.get_errors(trusted, k, minqual, false);
-			std::copy(suberrors.begin(), suberrors.end(), this->errors.begin()+bad_suffix);
+			//the prefix call didn't touch anything at or past bad_suffix.
+			this->find_errors(trusted, k, minqual, false, offset+bad_suffix, len-bad_suffix, scratch);
 		}
-		if(std::find(this->errors.begin(), this->errors.end(), true) != this->errors.end()){
-			corrected = true;
+	}
+
+	namespace{
+		//the finalizer of murmurhash3
+		inline uint64_t mix(uint64_t h){
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			return h ^ (h >> 33);
 		}
+	}
 
-		this->seq = original_seq;
-		return this->errors;
+	ErrorCache::ErrorCache(size_t size, int minqual): entries(size), minqual(minqual) {}
+
+	void ErrorCache::make_key(const CReadData& read, std::vector<uint64_t>& key) const{
+		const std::vector<uint64_t>& bases = read.seq.base_words();
+		const std::vector<uint64_t>& ns = read.seq.n_words();
+		size_t len = read.seq.length();
+		key.assign(bases.begin(), bases.end());
+		key.insert(key.end(), ns.begin(), ns.end());
+		size_t lowq = key.size();
+		key.resize(lowq + (len + 63) / 64, 0);
+		for(size_t i = 0; i < len; ++i){
+			key[lowq + (i >> 6)] |= (uint64_t)(read.qual[i] <= minqual) << (i & 63);
+		}
 	}
 
-	std::vector<uint8_t> CReadData::recalibrate(const covariateutils::dq_t& dqs, int minqual) const{
-		std::vector<int> recalibrated;
-		std::copy(this->qual.begin(), this->qual.end(), std::back_inserter(recalibrated));
-		int rg = this->get_rg_int();
-		for(int i = 0; i < this->seq.length(); ++i){
-			uint8_t q = this->qual[i];
-			if(q >= minqual){
-				recalibrated[i] = dqs.meanq[rg] + dqs.rgdq[rg] + dqs.qscoredq[rg][q] +
-					dqs.cycledq[rg][q][this->second][i];
-				if(i > 0){
-					int first = seq_nt16_int[seq_nt16_table[this->seq[i-1]]];
-					int second = seq_nt16_int[seq_nt16_table[this->seq[i]]];
-					if(first < 4 && second < 4){
-						int8_t dinuc = 15 & ((first << 2) | second); //1111 & (xx00|00xx)
-						recalibrated[i] += dqs.dinucdq[rg][q][dinuc];
-					}
-				}
+	const std::vector<bool>& ErrorCache::get_errors(CReadData& read, const bloom::Bloom& trusted, int k){
+		static thread_local CorrectionScratch scratch;
+		if(entries.empty()){
+			return read.get_errors(trusted, k, scratch, minqual);
+		}
+		std::vector<uint64_t>& key = scratch.cache_key;
+		this->make_key(read, key);
+		uint64_t hash = read.seq.length();
+		for(uint64_t word : key){
+			hash = mix(hash ^ word);
+		}
+		size_t slot = hash % entries.size();
+		Stripe& stripe = stripes[slot % nstripes];
+		{
+			std::lock_guard<std::mutex> lock(stripe.mtx);
+			const Entry& e = entries[slot];
+			if(e.hash == hash && e.len == read.seq.length() && e.key == key){
+				read.errors = e.errors;
+				++stripe.hits;
+				return read.errors;
 			}
+			++stripe.misses;
 		}
-		std::vector<uint8_t> ret;
-		std::transform(recalibrated.begin(), recalibrated.end(), std::back_inserter(ret),
-			[](int q)->uint8_t {return q < 0 ? 0 : KBBQ_MAXQ < q ? KBBQ_MAXQ : q;}); //std::clamp in c++17
-		return ret;
+		//correct without holding the lock; another thread may fill the slot meanwhile.
+		read.get_errors(trusted, k, scratch, minqual);
+		std::lock_guard<std::mutex> lock(stripe.mtx);
+		if(scratch.quality_tie){
+			++stripe.uncached;
+		} else {
+			Entry& e = entries[slot];
+			e.hash = hash;
+			e.len = read.seq.length();
+			e.key = key;
+			e.errors = read.errors;
+		}
+		return read.errors;
+	}
+
+	unsigned long long ErrorCache::hits() const{
+		unsigned long long n = 0;
+		for(const Stripe& stripe : stripes){
+			std::lock_guard<std::mutex> lock(stripe.mtx);
+			n += stripe.hits;
+		}
+		return n;
+	}
+
+	unsigned long long ErrorCache::misses() const{
+		unsigned long long n = 0;
+		for(const Stripe& stripe : stripes){
+			std::lock_guard<std::mutex> lock(stripe.mtx);
+			n += stripe.misses;
+		}
+		return n;
+	}
+
+	unsigned long long ErrorCache::uncached() const{
+		unsigned long long n = 0;
+		for(const Stripe& stripe : stripes){
+			std::lock_guard<std::mutex> lock(stripe.mtx);
+			n += stripe.uncached;
+		}
+		return n;
+	}
+
+	void CReadData::recalibrate(const covariateutils::RecalibrationTable& table, uint8_t* out) const{
+		table.recalibrate(this->rgid, this->second, this->seq, this->qual.data(), this->seq.length(), out);
 	}
 
 	CReadData CReadData::substr(size_t pos, size_t count) const{
@@ -1,14 +1,16 @@
 #include "recalibrateutils.hh"
+#include <thread>
+#include <mutex>
+#include <exception>
 
 using namespace htsiter;
 
 namespace recalibrateutils{
 
 void subsample_kmers(KmerSubsampler& s, bloom::Bloom& sampled){
-	for(bloom::Kmer kmer = s.next(); s.not_eof; kmer = s.next()){
-		if(kmer.valid()){
-			sampled.insert(kmer);
-		}
+	std::vector<uint64_t> kmers;
+	while(s.next_batch(kmers) > 0){
+		sampled.insert_batch(kmers);
 	}
 }
 
@@ -16,39 +18,102 @@ void find_trusted_kmers(HTSFile* file, bloom::Bloom& trusted,
 	const bloom::Bloom& sampled, std::vector<int> thresholds, int k)
 {
 	int n_trusted;
-	bloom::Kmer kmer(k);
+	std::vector<bloom::Kmer> kmers;
+	//only the kmers and qualities are needed here, so the rest of the read isn't copied.
+	std::vector<uint8_t> qual;
+	std::vector<bool> errors;
 	//the order here matters since we don't want to advance the iterator if we're chunked out
 	while(file->next() >= 0){
-		readutils::CReadData read = file->get();
-		read.infer_read_errors(sampled, thresholds, k);
+		file->get_kmers(kmers, k);
+		file->get_qual(qual);
+		errors.assign(qual.size(), false);
+		readutils::CReadData::infer_errors(bloom::overlapping_kmers_in_bf(kmers, qual.size(), sampled, k),
+			qual, thresholds, k, errors);
 		n_trusted = 0;
-		kmer.reset();
-		for(int i = 0; i < read.seq.length(); ++i){
-			kmer.push_back(read.seq[i]);
-			if(!read.errors[i]){
+		for(int i = 0; i < qual.size(); ++i){
+			if(!errors[i]){
 				++n_trusted;
 			}
-			if(i >= k && !read.errors[i-k]){
+			if(i >= k && !errors[i-k]){
 				--n_trusted;
 			}
-			if(kmer.valid() && n_trusted == k){
-				trusted.insert(kmer);
+			if(i >= k-1 && kmers[i-k+1].valid() && n_trusted == k){
+				trusted.insert(kmers[i-k+1]);
 				//trusted kmer here
 			}
 		}
 	}
 }
 
-covariateutils::CCovariateData get_covariatedata(HTSFile* file, const bloom::Bloom& trusted, int k){
+//the trusted filter is only read here, and the file is only touched with the lock held.
+static covariateutils::CCovariateData get_covariatedata_parallel(HTSFile* file, const bloom::Bloom& trusted, int k, int nthreads,
+	readutils::ErrorCache* cache)
+{
+	static const size_t batch_size = 512;
+	std::vector<covariateutils::CCovariateData> data(nthreads);
+	std::vector<std::exception_ptr> errors(nthreads);
+	std::mutex filemtx;
+	bool failed = false; //stop reading once any thread throws
+	std::vector<std::thread> workers;
+	for(int t = 0; t < nthreads; ++t){
+		workers.emplace_back([&, t](){
+			std::vector<readutils::CReadData> batch(batch_size);
+			size_t n = batch_size;
+			try{
+				while(n == batch_size){
+					{
+						std::lock_guard<std::mutex> lock(filemtx);
+						n = failed ? 0 : file->get_batch(batch);
+					}
+					for(size_t i = 0; i < n; ++i){
+						if(cache){
+							cache->get_errors(batch[i], trusted, k);
+						} else {
+							batch[i].get_errors(trusted, k, 6);
+						}
+						data[t].consume_read(batch[i]);
+					}
+				}
+			} catch(...) {
+				std::lock_guard<std::mutex> lock(filemtx);
+				failed = true;
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+	for(std::thread& worker : workers){
+		worker.join();
+	}
+	for(std::exception_ptr& e : errors){
+		if(e){std::rethrow_exception(e);}
+	}
+	for(int t = 1; t < nthreads; ++t){
+		data[0].merge(data[t]);
+	}
+	data[0].flush();
+	return std::move(data[0]);
+}
+
+covariateutils::CCovariateData get_covariatedata(HTSFile* file, const bloom::Bloom& trusted, int k, int nthreads,
+	readutils::ErrorCache* cache)
+{
+	if(nthreads > 1){
+		return get_covariatedata_parallel(file, trusted, k, nthreads, cache);
+	}
 	covariateutils::CCovariateData data;
 #ifndef NDEBUG
 	std::ifstream errorsin("../../adamjorr-Lighter/corrected.txt");
 	int linenum = 0;
 	std::string line = "";
 #endif
+	readutils::CReadData read;
 	while(file->next() >= 0){
-		readutils::CReadData read = file->get();
-		read.get_errors(trusted, k, 6);
+		file->get(read);
+		if(cache){
+			cache->get_errors(read, trusted, k);
+		} else {
+			read.get_errors(trusted, k, 6);
+		}
 #ifndef NDEBUG
 		//check that errors are same
 		std::getline(errorsin, line);
@@ -74,7 +139,7 @@ covariateutils::CCovariateData get_covariatedata(HTSFile* file, const bloom::Blo
 				std::cerr << v;
 			}
 			std::cerr << std::endl;
-			std::cerr << "Seq: " << read.seq << std::endl;
+			std::cerr << "Seq: " << read.seq.str() << std::endl;
 			// bloom::Kmer kmer(k);
 			// for(const char& c : std::string("CAGAATAGAAAGATTTATAAATTAAATACTC")){
 			// 	std::cerr << c << ":" << seq_nt4_table[c] << ":" << kmer.push_back(c) << "," ;
@@ -85,6 +150,7 @@ covariateutils::CCovariateData get_covariatedata(HTSFile* file, const bloom::Blo
 #endif
 		data.consume_read(read);
 	}
+	data.flush();
 	return data;
 }
 
@@ -93,10 +159,9 @@ void recalibrate_and_write(HTSFile* in, const covariateutils::dq_t& dqs, std::st
 		//error!! TODO
 		return;
 	}
+	covariateutils::RecalibrationTable table(dqs);
 	while(in->next() >= 0){
-		readutils::CReadData read = in->get();
-		std::vector<uint8_t> newquals = read.recalibrate(dqs);
-		in->recalibrate(newquals);
+		in->recalibrate(table);
 		if(in->write() < 0){
 			//error! TODO
 			return;